@@ -1,5 +1,12 @@
 #include "apu.h"
+#include "bus.h"
 
 u8 NR50_register = 0x77;
 
+static u8 NR50_read(u16 addr) { return NR50_register; }
+
+static void NR50_write(u16 addr, u8 data) { NR50_register = data; }
+
+void apu_mapIO() { bus_mapIO(0xFF24, &NR50_read, &NR50_write, 0x00); }
+
 // TODO sound
@@ -3,5 +3,7 @@
 
 #include "types.h"
 
+void apu_mapIO();
+
 extern u8 NR50_register;
 #endif
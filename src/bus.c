@@ -9,6 +9,9 @@
 static u8 WORK_RAM[0x2000];
 static u8 HRAM[0x7F];
 
+u8 *readPages[0x100];
+u8 *writePages[0x100];
+
 #ifdef TEST_CHECK
 static void printBlarggTest(u16 addr, u8 data) {
     static u8 blarggBYTE;
@@ -24,19 +27,103 @@ static void printBlarggTest(u16 addr, u8 data) {
 }
 #endif
 
-u8 bus_read(u16 addr, bool tick) {
-    // when memory is unreachable return 0xFF
-    u8 val = 0xFF;
+// handlers of the I/O registers 0xFF00-0xFF7F, a missing read handler reads 0xFF
+// and a missing write handler ignores the write
+typedef struct {
+    IO_readHandler read;
+    IO_writeHandler write;
+    // unused bits read as 1
+    u8 readMask;
+} IO_register;
+
+static IO_register IO_registers[0x80];
+
+// RAM pages that hold cached code, their writes go through bus_writeSlow
+static bool codePages[0x100];
+
+// size must be a multiple of the page size
+void bus_map(u16 addr, u16 size, u8 *readMem, u8 *writeMem) {
+    for (u16 offset = 0; offset < size; offset += 0x100) {
+        readPages[(addr + offset) >> 8] = (readMem != NULL) ? readMem + offset : NULL;
+        writePages[(addr + offset) >> 8] = (writeMem != NULL) ? writeMem + offset : NULL;
+    }
+    // the block being run might have been mapped out
+    cpu_endBlock();
+}
 
-    if (tick)
-        tick_TCycles(4);
+void bus_mapIO(u16 addr, IO_readHandler read, IO_writeHandler write, u8 readMask) {
+    IO_register *reg = &IO_registers[addr - 0xFF00];
 
-    // if(oam.state == ACTIVE && (addr < 0xFF80 || addr == 0xFFFF)){
-    //     val = oam.currTransByte;
-    //     goto incr1;
-    // }
+    reg->read = read;
+    reg->write = write;
+    reg->readMask = readMask;
+}
 
+static void serial_write(u16 addr, u8 data) {
+#ifdef TEST_CHECK
+    printBlarggTest(addr, data);
+#endif
+}
+
+// host address of an opcode the cpu may cache, only ROM, work RAM and HRAM are allowed
+u8 *bus_codePointer(u16 addr) {
     if (addr < 0x8000)
+        return (readPages[addr >> 8] != NULL) ? readPages[addr >> 8] + (addr & 0xFF) : NULL;
+    else if (addr >= 0xC000 && addr < 0xE000)
+        return &WORK_RAM[addr - 0xC000];
+    else if (addr >= 0xFF80 && addr < 0xFFFF)
+        return &HRAM[addr - 0xFF80];
+    return NULL;
+}
+
+void bus_watchCode(u8 page) {
+    // ROM can't be written
+    if (page < 0xC0 || codePages[page])
+        return;
+
+    codePages[page] = true;
+    if (page < 0xE0)
+        writePages[page] = NULL;
+}
+
+static void codePage_written(u8 page) {
+    codePages[page] = false;
+    if (page < 0xE0)
+        writePages[page] = &WORK_RAM[(page - 0xC0) << 8];
+    cpu_invalidateCode(page);
+}
+
+void bus_init() {
+    // VRAM writes go through the handler so that the ppu gets synced first
+    bus_map(0x8000, 0x2000, VRAM, NULL);
+    bus_map(0xC000, 0x2000, WORK_RAM, WORK_RAM);
+
+    joypad_mapIO();
+    bus_mapIO(0xFF01, NULL, &serial_write, 0x00);
+    bus_mapIO(0xFF02, NULL, &serial_write, 0x00);
+    timers_mapIO();
+    cpu_mapIO();
+    apu_mapIO();
+    ppu_mapIO();
+}
+
+static u8 bus_readMemory(u16 addr) {
+    // when memory is unreachable return 0xFF
+    u8 val = 0xFF;
+
+    // the I/O page is checked first, it is the one polled the most
+    if (addr >= 0xFF00) {
+        if (addr < 0xFF80) {
+            IO_register *reg = &IO_registers[addr - 0xFF00];
+            if (reg->read != NULL)
+                val = (*reg->read)(addr) | reg->readMask;
+        }
+        else if (addr < 0xFFFF)
+            val = HRAM[addr - 0xFF80];
+        else
+            val = IE_register;
+    }
+    else if (addr < 0x8000)
         val = (*cartridge_read)(addr);
     else if (addr < 0xA000)
         val = VRAM[addr - 0x8000];
@@ -48,65 +135,74 @@ u8 bus_read(u16 addr, bool tick) {
         printf("Prohibited memory area, addr = 0x%04X \n", addr);
     else if (addr < 0xFEA0)
         val = oam_read(addr);
-    else if (addr < 0xFF00)
-        printf("Prohibited memory area, addr = 0x%04X \n", addr);
-    else if (addr < 0xFF80) {
-        if (addr == 0xFF00)
-            val = joypad_read();
-        else if (addr >= 0xFF03 && addr <= 0xFF07)
-            val = timers_read(addr);
-        else if (addr == 0xFF0F)
-            val = IF_register;
-        else if (addr == 0xFF24)
-            val = NR50_register;
-        else if (addr >= 0xFF40 && addr <= 0xFF4B)
-            val = read_ppu(addr);
-    }
-    else if (addr < 0xFFFF)
-        val = HRAM[addr - 0xFF80];
     else
-        val = IE_register;
+        printf("Prohibited memory area, addr = 0x%04X \n", addr);
 
     return val;
 }
 
-void bus_write(u16 addr, u8 data, bool tick) {
-    if (tick)
-        tick_TCycles(4);
+// ROM, cartridge RAM and work RAM share the external bus, VRAM has a bus of its own
+static bool bus_isVRAM(u16 addr) { return addr >= 0x8000 && addr < 0xA000; }
 
-    if (addr < 0x8000)
+// accesses to pages without a host pointer, and every read during a DMA, end up here
+u8 bus_readSlow(u16 addr) {
+    // the registers behind the handlers must see every event that is due
+    timing_catchUp();
+
+    // once the DMA has started copying it owns OAM and the bus of its source, the cpu reads
+    // the byte the DMA moves there, the other bus, I/O and HRAM can still be read as usual
+    if (oam.state == ACTIVE && addr < 0xFF00) {
+        ppu_sync();
+        if (oam.state == ACTIVE && oam.numTransferred != 0) {
+            if (addr >= 0xFE00)
+                return 0xFF;
+            if (bus_isVRAM(addr) == bus_isVRAM(oam.sourceAddr))
+                return oam.currTransByte;
+        }
+    }
+
+    return bus_readMemory(addr);
+}
+
+// the DMA reads its source past its own conflicts
+u8 bus_readDMA(u16 addr) {
+    timing_catchUp();
+    return bus_readMemory(addr);
+}
+
+void bus_writeSlow(u16 addr, u8 data) {
+    timing_catchUp();
+
+    if (addr >= 0xFF00) {
+        if (addr < 0xFF80) {
+            IO_register *reg = &IO_registers[addr - 0xFF00];
+            if (reg->write != NULL)
+                (*reg->write)(addr, data);
+        }
+        else if (addr < 0xFFFF) {
+            HRAM[addr - 0xFF80] = data;
+            if (codePages[0xFF])
+                codePage_written(0xFF);
+        }
+        else
+            cpu_writeIE(data);
+    }
+    else if (addr < 0x8000)
         (*cartridge_write)(addr, data);
     else if (addr < 0xA000)
-        VRAM[addr - 0x8000] = data;
+        vram_write(addr, data);
     else if (addr < 0xC000)
         (*cartridge_write)(addr, data);
-    else if (addr < 0xE000)
+    else if (addr < 0xE000) {
+        // only pages that hold cached code get here
         WORK_RAM[addr - 0xC000] = data;
+        if (codePages[addr >> 8])
+            codePage_written(addr >> 8);
+    }
     else if (addr < 0xFE00)
         printf("Prohibited memory area, addr = 0x%04X \n", addr);
     else if (addr < 0xFEA0)
         oam_write(addr, data);
-    else if (addr < 0xFF00)
-        printf("Prohibited memory area, addr = 0x%04X \n", addr);
-    else if (addr < 0xFF80) {
-        if (addr == 0xFF00)
-            joypad_write(data);
-        else if (addr == 0xFF01 || addr == 0xFF02) {
-#ifdef TEST_CHECK
-            printBlarggTest(addr, data);
-#endif
-        }
-        else if (addr >= 0xFF03 && addr <= 0xFF07)
-            timers_write(addr, data);
-        else if (addr == 0xFF0F)
-            IF_register = data | 0xE0;
-        else if (addr == 0xFF24)
-            NR50_register = data;
-        else if (addr >= 0xFF40 && addr <= 0xFF4B)
-            write_ppu(addr, data);
-    }
-    else if (addr < 0xFFFF)
-        HRAM[addr - 0xFF80] = data;
     else
-        IE_register = data;
+        printf("Prohibited memory area, addr = 0x%04X \n", addr);
 }
@@ -9,7 +9,51 @@
 #include "timing.h"
 #include "types.h"
 
-u8 bus_read(u16 addr, bool tick);
-void bus_write(u16 addr, u8 data, bool tick);
+// the address space is split in 256 pages of 256 bytes, each page points to
+// the host memory that backs it, or is NULL when the access needs a handler
+extern u8 *readPages[0x100];
+extern u8 *writePages[0x100];
+
+typedef u8 (*IO_readHandler)(u16 addr);
+typedef void (*IO_writeHandler)(u16 addr, u8 data);
+
+void bus_init();
+void bus_map(u16 addr, u16 size, u8 *readMem, u8 *writeMem);
+void bus_mapIO(u16 addr, IO_readHandler read, IO_writeHandler write, u8 readMask);
+u8 *bus_codePointer(u16 addr);
+void bus_watchCode(u8 page);
+u8 bus_readSlow(u16 addr);
+u8 bus_readDMA(u16 addr);
+void bus_writeSlow(u16 addr, u8 data);
+
+static inline u8 bus_read(u16 addr, bool tick) {
+    u8 *page;
+
+    if (tick)
+        tick_TCycles(4);
+
+    // while the DMA runs the reads go through its bus conflicts
+    page = readPages[addr >> 8];
+    if (page != NULL && oam.state == INACTIVE)
+        return page[addr & 0xFF];
+    return bus_readSlow(addr);
+}
+
+static inline void bus_write(u16 addr, u8 data, bool tick) {
+    u8 *page;
+
+    if (tick)
+        tick_TCycles(4);
+
+    // the DMA must read the source before it gets overwritten
+    if (oam.state == ACTIVE)
+        ppu_sync();
+
+    page = writePages[addr >> 8];
+    if (page != NULL)
+        page[addr & 0xFF] = data;
+    else
+        bus_writeSlow(addr, data);
+}
 
 #endif
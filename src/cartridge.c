@@ -1,4 +1,5 @@
 #include "cartridge.h"
+#include "bus.h"
 
 #include <assert.h>
 #include <stddef.h>
@@ -71,6 +72,47 @@ static u8 MBC3_read(u16 addr) {
     return 0xFF;
 }
 
+// point the bus pages to the currently selected banks,
+// disabled or unsupported RAM is left to the read/write handlers
+static void MBCnone_map() { bus_map(0x0000, 0x8000, cart.loadedFile, NULL); }
+
+static void MBC1_map() {
+    u8 *RAM = NULL;
+
+    bus_map(0x0000, 0x4000, &cart.loadedFile[mbc1->mode ? 0x4000 * mbc1->zeroBankNum : 0], NULL);
+    bus_map(0x4000, 0x4000, &cart.loadedFile[0x4000 * mbc1->highBankNum], NULL);
+
+    if (mbc1->ramEnable) {
+        switch (cart.RAMtype) {
+            case _2K_RAM:
+                // mirrored across the whole area
+                for (u16 addr = 0xA000; addr < 0xC000; addr += 0x800)
+                    bus_map(addr, 0x800, cart.externalRAM, cart.externalRAM);
+                return;
+            case _8K_RAM:
+                RAM = cart.externalRAM;
+                break;
+            case _32K_RAM:
+                RAM = &cart.externalRAM[mbc1->mode ? 0x2000 * mbc1->ramBankNum : 0];
+                break;
+            default:
+                break;
+        }
+    }
+    bus_map(0xA000, 0x2000, RAM, RAM);
+}
+
+static void MBC3_map() {
+    u8 *RAM = NULL;
+
+    bus_map(0x0000, 0x4000, cart.loadedFile, NULL);
+    bus_map(0x4000, 0x4000, &cart.loadedFile[0x4000 * mbc3->romBankNum], NULL);
+
+    if (mbc3->ramEnable && 0x2000 * (mbc3->ramBankNum + 1) <= cart.RAMsize)
+        RAM = &cart.externalRAM[0x2000 * mbc3->ramBankNum];
+    bus_map(0xA000, 0x2000, RAM, RAM);
+}
+
 static void MBCnone_write(u16 addr, u8 data) {
     // do nothing
 }
@@ -99,6 +141,9 @@ static void MBC1_write(u16 addr, u8 data) {
     }
     else if (addr < 0x8000)
         mbc1->mode = data & 1;
+
+    if (addr < 0x8000)
+        MBC1_map();
     else if (addr >= 0xA000 && addr <= 0xBFFF) {
         if (mbc1->ramEnable) {
             switch (cart.RAMtype) {
@@ -138,6 +183,9 @@ static void MBC3_write(u16 addr, u8 data) {
     else if (addr < 0x8000)
         // TODO RTC
         printf("RTC NOT IMPLEMENTED! \n");
+
+    if (addr < 0x8000)
+        MBC3_map();
     else if (addr >= 0xA000 && addr <= 0xBFFF) {
         if (mbc3->ramEnable)
             cart.externalRAM[0x2000 * mbc3->ramBankNum + (addr - 0xA000)] = data;
@@ -255,6 +303,7 @@ void cartridge_load(char *filePath) {
         case MBC_NONE:
             cartridge_read = &MBCnone_read;
             cartridge_write = &MBCnone_write;
+            MBCnone_map();
             break;
         case MBC1:
         case MBC1_RAM:
@@ -264,12 +313,14 @@ void cartridge_load(char *filePath) {
             MBC1_init();
             cartridge_read = &MBC1_read;
             cartridge_write = &MBC1_write;
+            MBC1_map();
             break;
         case MBC3_BAT:
             mbc3 = (MBC3_chip *)malloc(sizeof(MBC3_chip));
             MBC3_init();
             cartridge_read = &MBC3_read;
             cartridge_write = &MBC3_write;
+            MBC3_map();
             break;
         default:
             printf("MBC type 0x%02X not supported. \n", cart.MBCtype);
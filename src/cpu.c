@@ -1,12 +1,31 @@
 #include "cpu.h"
-#include "joypad.h"
+#include "cpu_internal.h"
+#include "fusion.h"
 #include "ppu.h"
 #include "timers.h"
 #include "timing.h"
 
 #include <stdbool.h>
+#include <string.h>
 
-static cpu _cpu;
+// keep the register file at the start of its own cache line
+static _Alignas(64) cpu _cpu;
+decodedInstr decodedInstrs[0x200];
+
+#define NO_FUSION 0xFFFF
+
+// the fused handler is stored in the first instruction, the second one keeps its own operands
+typedef struct fusedInstr {
+    u16 opcodes[2];
+    decodedInstr instrs[2];
+} fusedInstr;
+
+#define FUSION_PAIR(first, second) {first, second},
+static const u16 fusionPairs[][2] = {FUSION_PAIRS(FUSION_PAIR)};
+#define NUM_FUSION_PAIRS (sizeof(fusionPairs) / sizeof(fusionPairs[0]))
+
+static fusedInstr fusedInstrs[NUM_FUSION_PAIRS];
+static u16 numFusedInstrs;
 u8 IE_register;
 u8 IF_register;
 
@@ -14,380 +33,187 @@ u8 IF_register;
 bool testPassed = false;
 #endif
 
-static u8 reg_read(cpu cpu, instr_op reg) {
-    switch (reg) {
-        case REG_A:
-            return cpu.A;
-        case REG_B:
-            return cpu.B;
-        case REG_C:
-            return cpu.C;
-        case REG_D:
-            return cpu.D;
-        case REG_E:
-            return cpu.E;
-        case REG_H:
-            return cpu.H;
-        case REG_L:
-            return cpu.L;
-        default:
-            printf("Attempted to read an invalid register. \n");
-            exit(0);
-    }
-};
-
-static u16 reg_read16(cpu cpu, instr_op reg) {
-    switch (reg) {
-        case REG_HL:
-            return *((u16 *)&cpu.L);
-        case REG_BC:
-            return *((u16 *)&cpu.C);
-        case REG_DE:
-            return *((u16 *)&cpu.E);
-        case REG_AF:
-            return *((u16 *)&cpu.F);
-        case REG_SP:
-            return cpu.SP;
-        case REG_PC:
-            return cpu.PC;
-        default:
-            printf("Attempted to read an invalid register. \n");
-            exit(0);
-    }
-};
-
-static void reg_write(cpu *cpu, instr_op reg, u8 val) {
-    switch (reg) {
-        case REG_A:
-            cpu->A = val;
-            break;
-        case REG_B:
-            cpu->B = val;
-            break;
-        case REG_C:
-            cpu->C = val;
-            break;
-        case REG_D:
-            cpu->D = val;
-            break;
-        case REG_E:
-            cpu->E = val;
-            break;
-        case REG_H:
-            cpu->H = val;
-            break;
-        case REG_L:
-            cpu->L = val;
-            break;
-        default:
-            printf("Attempted to write to a non valid register. \n");
-            exit(0);
-    }
-};
+// the flags are evaluated lazily, every ALU operation only stores what each flag is derived from
+static u8 flags_read(cpu *cpu) {
+    u8 F = (cpu->lazyZ == 0) << Z;
+    F |= cpu->lazyN << N;
+    F |= ((cpu->lazyH >> 4) & 1) << H;
+    F |= ((cpu->lazyC >> 8) & 1) << C;
+    return F;
+}
 
-static void reg_write16(cpu *cpu, instr_op reg, u16 val) {
-    switch (reg) {
-        case REG_HL:
-            *((u16 *)(&cpu->L)) = val;
-            break;
-        case REG_BC:
-            *((u16 *)(&cpu->C)) = val;
-            break;
-        case REG_DE:
-            *((u16 *)(&cpu->E)) = val;
-            break;
-        case REG_AF:
-            // 4 lsbs are always 0 in register F
-            *((u16 *)(&cpu->F)) = val & 0xFFF0;
-            break;
-        case REG_SP:
-            cpu->SP = val;
-            return;
-        case REG_PC:
-            cpu->PC = val;
-            return;
-        default:
-            printf("Attempted to write to a non valid register. \n");
-            exit(0);
-    }
-};
+static void flags_write(cpu *cpu, u8 F) {
+    cpu->lazyZ = ~F & 0x80;
+    cpu->lazyN = bit_read(F, N);
+    cpu->lazyH = (F >> 1) & 0x10;
+    cpu->lazyC = (F & 0x10) << 4;
+}
 
 #ifdef DEBUG
-static void reg_print(FILE *fp, cpu cpu) {
-    fprintf(fp, "A:%02X ", cpu.A);
-    fprintf(fp, "F:%02X ", cpu.F);
-    fprintf(fp, "B:%02X ", cpu.B);
-    fprintf(fp, "C:%02X ", cpu.C);
-    fprintf(fp, "D:%02X ", cpu.D);
-    fprintf(fp, "E:%02X ", cpu.E);
-    fprintf(fp, "H:%02X ", cpu.H);
-    fprintf(fp, "L:%02X ", cpu.L);
-    fprintf(fp, "SP:%04X ", cpu.SP);
-    fprintf(fp, "PC:%04X ", cpu.PC);
-    fprintf(fp, "TIMA:%02X ", tima.reg);
-    fprintf(fp, "DIV:%04X ", DIV_register);
-    fprintf(fp, "PCMEM:%02X,%02X,%02X,%02X", bus_read(cpu.PC, false), bus_read(cpu.PC + 1, false), bus_read(cpu.PC + 2, false), bus_read(cpu.PC + 3, false));
+void reg_print(FILE *fp, cpu *cpu) {
+    fprintf(fp, "A:%02X ", cpu->A);
+    fprintf(fp, "F:%02X ", flags_read(cpu));
+    fprintf(fp, "B:%02X ", cpu->B);
+    fprintf(fp, "C:%02X ", cpu->C);
+    fprintf(fp, "D:%02X ", cpu->D);
+    fprintf(fp, "E:%02X ", cpu->E);
+    fprintf(fp, "H:%02X ", cpu->H);
+    fprintf(fp, "L:%02X ", cpu->L);
+    fprintf(fp, "SP:%04X ", cpu->SP);
+    fprintf(fp, "PC:%04X ", cpu->PC);
+    fprintf(fp, "TIMA:%02X ", timers_read(0xFF05));
+    fprintf(fp, "DIV:%04X ", timers_DIV());
+    fprintf(fp, "PCMEM:%02X,%02X,%02X,%02X", bus_read(cpu->PC, false), bus_read(cpu->PC + 1, false), bus_read(cpu->PC + 2, false), bus_read(cpu->PC + 3, false));
     fprintf(fp, "\n");
 };
 #endif
 
-// TODO remove fetch_data completely
-static u16 fetch_data(cpu *cpu, instr_op addr) {
-    u16 data;
-
-    switch (addr) {
-        case REG_A:
-        case REG_B:
-        case REG_C:
-        case REG_D:
-        case REG_E:
-        case REG_H:
-        case REG_L:
-            data = reg_read(*cpu, addr);
-            break;
-        case REG_BC:
-        case REG_DE:
-        case REG_HL:
-        case REG_SP:
-        case REG_PC:
-        case REG_AF:
-            data = reg_read16(*cpu, addr);
-            break;
-        case DATA_HL: {
-            u16 raddr = reg_read16(*cpu, REG_HL);
-            data = bus_read(raddr, true);
-            break;
-        }
-        case DATA_BC: {
-            u16 raddr = reg_read16(*cpu, REG_BC);
-            data = bus_read(raddr, true);
-            break;
-        }
-        case DATA_DE: {
-            u16 raddr = reg_read16(*cpu, REG_DE);
-            data = bus_read(raddr, true);
-            break;
-        }
-        case DATA_N: {
-            // get 1 byte and add it to 0xFF00
-            u8 val = bus_read(cpu->PC++, true);
-            u16 raddr = 0xFF00 + val;
-            data = bus_read(raddr, true);
-            break;
-        }
-        case DATA_C: {
-            u8 val = reg_read(*cpu, REG_C);
-            addr = 0xFF00 + val;
-            data = bus_read(addr, true);
-            break;
-        }
-        case IM_DATA8:
-            data = bus_read(cpu->PC++, true);
-            break;
-        case IM_DATA16: {
-            val16 val;
-            val.lsb = bus_read(cpu->PC++, true);
-            val.msb = bus_read(cpu->PC++, true);
-            data = val.val;
-            break;
-        }
-        case DATA_NN: {
-            u16 raddr = fetch_data(cpu, IM_DATA16);
-            data = bus_read(raddr, true);
-            break;
-        }
-        default:
-            printf("Invalid addr %d \n", addr);
-            exit(0);
-    }
-    return data;
-};
-
-// TODO remove write_data completely
-static void write_data(cpu *cpu, instr_op instr_op, u16 val) {
-    switch (instr_op) {
-        case REG_A:
-        case REG_B:
-        case REG_C:
-        case REG_D:
-        case REG_E:
-        case REG_H:
-        case REG_L:
-            reg_write(cpu, instr_op, val);
-            break;
-        case REG_AF:
-        case REG_BC:
-        case REG_DE:
-        case REG_HL:
-        case REG_SP:
-        case REG_PC:
-            reg_write16(cpu, instr_op, val);
-            break;
-        case DATA_HL: {
-            u16 wraddr = reg_read16(*cpu, REG_HL);
-            bus_write(wraddr, val, true);
-            break;
-        }
-        case DATA_BC: {
-            u16 wraddr = reg_read16(*cpu, REG_BC);
-            bus_write(wraddr, val, true);
-            break;
-        }
-        case DATA_DE: {
-            u16 wraddr = reg_read16(*cpu, REG_DE);
-            bus_write(wraddr, val, true);
-            break;
-        }
-        case DATA_NN: {
-            u16 wraddr = fetch_data(cpu, IM_DATA16);
-            bus_write(wraddr, val, true);
-            break;
-        }
-        case DATA_NN16: {
-            u16 wraddr = fetch_data(cpu, IM_DATA16);
-            bus_write(wraddr++, u16_lsb(&val), true);
-            bus_write(wraddr, u16_msb(&val), true);
-            break;
-        }
-        case DATA_N: {
-            u16 wraddr = fetch_data(cpu, IM_DATA8);
-            wraddr += 0xFF00;
-            bus_write(wraddr, val, true);
-            break;
-        }
-        case DATA_C: {
-            u16 wraddr = reg_read(*cpu, REG_C);
-            wraddr += 0xFF00;
-            bus_write(wraddr, val, true);
-            break;
-        }
-        default:
-            printf("Invalid addr %d", instr_op);
-            exit(0);
-    }
-};
-
-static bool flag_reg_read(cpu *cpu, FLAG flag) { return bit_read(cpu->F, flag); }
-
-static void flag_reg_write(cpu *cpu, FLAG flag, bool bval) { bit_write(&cpu->F, flag, bval); }
-
-static bool add_isHC8(u8 a, u8 b) { return (((a & 0xF) + (b & 0xF)) & 0x10) == 0x10; }
-
-static bool add_isC8(u8 a, u8 b) { return ((a + b) & 0x100) == 0x100; }
-
-static bool add_isHC16(u16 a, u16 b) { return (((a & 0xFFF) + (b & 0xFFF)) & 0x1000) == 0x1000; }
-
-static bool add_isC16(u16 a, u16 b) { return ((a + b) & 0x10000) == 0x10000; }
-
-static bool adc_isHC8(u8 a, u8 b, u8 c) { return (((a & 0x0F) + (b & 0x0F) + (c & 0x0F)) & 0x10) == 0x10; }
-
-static bool adc_isC8(u8 a, u8 b, u8 c) { return ((a + b + c) & 0x100) == 0x100; }
+static u16 fetch_imm16(cpu *cpu) {
+    val16 val;
+    val.lsb = bus_read(cpu->PC++, true);
+    val.msb = bus_read(cpu->PC++, true);
+    return val.val;
+}
 
-static bool sub_isHC8(u8 a, u8 b) { return (((a & 0xF) - (b & 0xF)) & 0x10) == 0x10; }
+static bool flag_H(cpu *cpu) { return (cpu->lazyH >> 4) & 1; }
 
-static bool sub_isC8(u8 a, u8 b) { return ((a - b) & 0x100) == 0x100; }
+static bool flag_C(cpu *cpu) { return (cpu->lazyC >> 8) & 1; }
 
-static bool addSigned_isHC(u16 a, int8 b) { return (((a & 0xF) + (b & 0xF)) & 0x10) == 0x10; }
+// the results of the rotates and the logical operations only set Z
+static void flags_logic(cpu *cpu, u8 res, u8 H, u16 C) {
+    cpu->lazyZ = res;
+    cpu->lazyN = 0;
+    cpu->lazyH = H;
+    cpu->lazyC = C;
+}
 
-static bool addSigned_isC(u16 a, int8 b) { return (((a & 0xFF) + (b & 0xFF)) & 0x100) == 0x100; }
+static bool cond_check(cpu *cpu, const decodedInstr *instr) {
+    bool flag = (instr->flagMask == (1 << Z)) ? cpu->lazyZ == 0 : flag_C(cpu);
+    return flag == (instr->flagExpect != 0);
+}
 
-static void stack_push(cpu *cpu, instr_op reg) {
+static void stack_push(cpu *cpu, u16 reg) {
     tick_MCycle();
     tick_MCycle();
-    val16 val = (val16)reg_read16(*cpu, reg);
+    val16 val = (val16)reg;
     bus_write(--cpu->SP, val.msb, true);
     bus_write(--cpu->SP, val.lsb, true);
 }
 
-static void stack_pop(cpu *cpu, instr_op reg) {
+static u16 stack_pop(cpu *cpu) {
     val16 val;
     val.lsb = bus_read(cpu->SP++, true);
     val.msb = bus_read(cpu->SP++, true);
-    reg_write16(cpu, reg, val.val);
-}
-
-static void clear_NH_flags(cpu *cpu) {
-    bit_clear(&cpu->F, N);
-    bit_clear(&cpu->F, H);
+    return val.val;
 }
 
-static void execute_SWAP(cpu *cpu, instruction instr) {
-    u8 currVal;
-    u8 swappedVal;
-
-    tick_MCycle();
-    currVal = fetch_data(cpu, instr.op_a);
-    swappedVal = (currVal >> 4) | (currVal << 4);
-
-    write_data(cpu, instr.op_a, swappedVal);
-
-    flag_reg_write(cpu, Z, swappedVal == 0);
-    clear_NH_flags(cpu);
-    bit_clear(&cpu->F, C);
-    tick_MCycle();
+u16 shiftTable[NUM_SHIFT_OPS][2][0x100];
+u16 DAATable[8][0x100];
+
+static u16 shift_compute(SHIFT_OP op, u8 val, bool Cflag) {
+    switch (op) {
+        case SHIFT_RLC:
+            return (u8)((val << 1) | (val >> 7)) | (val & 0x80) << 1;
+        case SHIFT_RRC:
+            return (u8)((val >> 1) | (val << 7)) | (val & 0x01) << 8;
+        case SHIFT_RL:
+            return (u8)((val << 1) | Cflag) | (val & 0x80) << 1;
+        case SHIFT_RR:
+            return (u8)((val >> 1) | (Cflag << 7)) | (val & 0x01) << 8;
+        case SHIFT_SLA:
+            return (u8)(val << 1) | (val & 0x80) << 1;
+        case SHIFT_SRA:
+            return (u8)((val >> 1) | (val & 0x80)) | (val & 0x01) << 8;
+        case SHIFT_SWAP:
+            return (u8)((val >> 4) | (val << 4));
+        case SHIFT_SRL:
+        default:
+            return (u8)(val >> 1) | (val & 0x01) << 8;
+    }
 }
 
 // taken from https://ehaskins.com/2018-01-30%20Z80%20DAA/
-static void execute_DAA(cpu *cpu) {
-    u8 val = cpu->A;
-
-    if (!flag_reg_read(cpu, N)) { // after an addition, adjust if (half-)carry occurred or if result is out of bounds
-        if (flag_reg_read(cpu, C) || val > 0x99) {
+static u16 DAA_compute(u8 val, bool Nflag, bool Hflag, bool Cflag) {
+    if (!Nflag) { // after an addition, adjust if (half-)carry occurred or if result is out of bounds
+        if (Cflag || val > 0x99) {
             val += 0x60;
-            flag_reg_write(cpu, C, 1);
+            Cflag = 1;
         }
-        if (flag_reg_read(cpu, H) || (val & 0x0f) > 0x09) {
+        if (Hflag || (val & 0x0f) > 0x09) {
             val += 0x6;
         }
     }
     else { // after a subtraction, only adjust if (half-)carry occurred
-        if (flag_reg_read(cpu, C)) {
+        if (Cflag) {
             val -= 0x60;
         }
-        if (flag_reg_read(cpu, H)) {
+        if (Hflag) {
             val -= 0x6;
         }
     }
 
-    flag_reg_write(cpu, Z, val == 0);
-    bit_clear(&cpu->F, H);
+    return val | (Cflag << 8);
+}
+
+static void tables_init() {
+    for (u16 val = 0; val < 0x100; val++) {
+        for (u8 op = 0; op < NUM_SHIFT_OPS; op++) {
+            shiftTable[op][0][val] = shift_compute(op, val, 0);
+            shiftTable[op][1][val] = shift_compute(op, val, 1);
+        }
+        for (u8 NHC = 0; NHC < 8; NHC++)
+            DAATable[NHC][val] = DAA_compute(val, bit_read(NHC, 2), bit_read(NHC, 1), bit_read(NHC, 0));
+    }
+}
+
+static void execute_DAA(cpu *cpu) {
+    u8 NHC = (cpu->lazyN << 2) | (flag_H(cpu) << 1) | flag_C(cpu);
+    u16 res = DAATable[NHC][cpu->A];
+
+    cpu->lazyZ = res;
+    cpu->lazyH = 0;
+    cpu->lazyC = res;
 
     tick_MCycle();
 
-    cpu->A = val;
+    cpu->A = res;
 }
 
 static void execute_CPL(cpu *cpu) {
     cpu->A = ~cpu->A;
 
-    bit_set(&cpu->F, N);
-    bit_set(&cpu->F, H);
+    cpu->lazyN = 1;
+    cpu->lazyH = 0x10;
 
     tick_MCycle();
 }
 
 static void execute_CCF(cpu *cpu) {
-    bool Cflag = flag_reg_read(cpu, C);
-
-    flag_reg_write(cpu, C, !Cflag);
-    clear_NH_flags(cpu);
+    cpu->lazyC ^= 0x100;
+    cpu->lazyN = 0;
+    cpu->lazyH = 0;
 
     tick_MCycle();
 }
 
-void execute_SCF(cpu *cpu) {
-    clear_NH_flags(cpu);
-    bit_set(&cpu->F, C);
+static void execute_SCF(cpu *cpu) {
+    cpu->lazyC = 0x100;
+    cpu->lazyN = 0;
+    cpu->lazyH = 0;
 
     tick_MCycle();
 }
 
-void execute_NOP() {
+static void execute_NOP() {
     // do nothing
     tick_MCycle();
 }
 
-void execute_HALT(cpu *cpu) {
+// has to be called whenever IE, IF, IME, scheduledIME or isHalted change
+static void pending_update(cpu *cpu) { cpu->isPending = cpu->isHalted || cpu->scheduledIME || (cpu->IME && (IE_register & IF_register & 0x1F) != 0); }
+
+static void execute_HALT(cpu *cpu) {
+    timing_catchUp();
     // check if there are any interrupts pending
     bool isIntrPending = (IE_register & IF_register & 0x1F) != 0;
 
@@ -404,11 +230,12 @@ void execute_HALT(cpu *cpu) {
     else {
         // if there are no interrupts pending, the cpu is halted
         cpu->isHalted = true;
+        pending_update(cpu);
         tick_MCycle();
     }
 }
 
-void execute_STOP() {
+static void execute_STOP() {
     // TODO
     printf("Instruction STOP is not implemented. \n");
 }
@@ -416,942 +243,1529 @@ void execute_STOP() {
 static void execute_DI(cpu *cpu) {
     cpu->IME = false;
     cpu->scheduledIME = false;
+    pending_update(cpu);
     tick_MCycle();
 }
 
-void execute_EI(cpu *cpu) {
+static void execute_EI(cpu *cpu) {
     // the IME flag is enabled after one M cycle(= 4 T Cycles)
     cpu->scheduledIME = true;
+    pending_update(cpu);
     tick_MCycle();
 }
 
-static void execute_RL(cpu *cpu, instruction instr) {
-    u8 val;
-    u8 shiftedVal;
-    u8 newVal;
-    bool msb;
-    bool Cflag;
-
-    tick_MCycle();
-    val = fetch_data(cpu, instr.op_a);
-    // msb goes to the C flag
-    msb = bit_read(val, 7);
-    shiftedVal = val << 1;
-
-    Cflag = flag_reg_read(cpu, C);
-    newVal = shiftedVal + Cflag;
-
-    write_data(cpu, instr.op_a, newVal);
-    tick_MCycle();
+// the table entry doubles as lazyC, its bit 8 is the shifted out bit
+static u8 execute_shift(cpu *cpu, SHIFT_OP op, u8 val) {
+    u16 res = shiftTable[op][flag_C(cpu)][val];
 
-    flag_reg_write(cpu, Z, newVal == 0);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, msb);
+    flags_logic(cpu, res, 0, res);
+    return res;
 }
 
-static void execute_RLC(cpu *cpu, instruction instr) {
-    u8 val;
-    u8 shiftedVal;
-    bool msb;
+// RLCA, RLA, RRCA and RRA always clear Z
+static void execute_shiftA(cpu *cpu, SHIFT_OP op) {
+    u16 res = shiftTable[op][flag_C(cpu)][cpu->A];
 
-    tick_MCycle();
-    val = fetch_data(cpu, instr.op_a);
-    msb = bit_read(val, 7);
-    shiftedVal = ((val << 1) & 0xFE) | msb;
+    cpu->A = res;
+    flags_logic(cpu, 1, 0, res);
 
-    write_data(cpu, instr.op_a, shiftedVal);
     tick_MCycle();
-
-    flag_reg_write(cpu, Z, shiftedVal == 0);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, msb);
 }
 
-static void execute_RLCA(cpu *cpu) {
-    u8 val = cpu->A;
-    bool msb = bit_read(val, 7);
-
-    cpu->A = ((val << 1) & 0xFE) | msb;
+// for additions and subtractions, H is bit 4 of a ^ b ^ res and C is bit 8 of the unwrapped result
+static void execute_ADD(cpu *cpu, u8 b) {
+    u8 regA = cpu->A;
+    u16 res = regA + b;
 
-    bit_clear(&cpu->F, Z);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, msb);
+    cpu->lazyZ = res;
+    cpu->lazyN = 0;
+    cpu->lazyH = regA ^ b ^ res;
+    cpu->lazyC = res;
 
-    tick_MCycle();
+    cpu->A = res;
 }
 
-static void execute_RLA(cpu *cpu) {
-    u8 val = cpu->A;
-    bool msb = bit_read(val, 7);
-    bool Cflag = flag_reg_read(cpu, C);
-
-    cpu->A = (val << 1) | Cflag;
+// SP + e, used by both ADD SP, e and LD HL, SP + e
+static u16 execute_ADDSP(cpu *cpu, int8 e) {
+    u16 SPval = cpu->SP;
+    u16 res = SPval + e;
+    u16 carries = SPval ^ (u16)e ^ res;
 
-    bit_clear(&cpu->F, Z);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, msb);
+    cpu->lazyZ = 1;
+    cpu->lazyN = 0;
+    cpu->lazyH = carries;
+    cpu->lazyC = carries;
 
-    tick_MCycle();
+    return res;
 }
 
-static void execute_RR(cpu *cpu, instruction instr) {
-    u8 val;
-    u8 shiftedVal;
-    u8 newVal;
-    bool lsb;
-    bool Cflag;
+static u16 execute_ADD16(cpu *cpu, u16 a, u16 b) {
+    u32 res = a + b;
 
-    tick_MCycle();
-    val = fetch_data(cpu, instr.op_a);
+    cpu->lazyN = 0;
+    cpu->lazyH = (a ^ b ^ res) >> 8;
+    cpu->lazyC = res >> 8;
 
-    lsb = bit_read(val, 0);
-    shiftedVal = val >> 1;
-    Cflag = flag_reg_read(cpu, C);
+    return res;
+}
 
-    newVal = shiftedVal | (Cflag << 7);
+static void execute_ADC(cpu *cpu, u8 b) {
+    u8 a = cpu->A;
+    u16 sum = a + b + flag_C(cpu);
 
-    write_data(cpu, instr.op_a, newVal);
-    tick_MCycle();
+    cpu->A = sum;
 
-    flag_reg_write(cpu, Z, newVal == 0);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, lsb);
+    cpu->lazyZ = sum;
+    cpu->lazyN = 0;
+    cpu->lazyH = a ^ b ^ sum;
+    cpu->lazyC = sum;
 }
 
-static void execute_RRC(cpu *cpu, instruction instr) {
-    u8 val;
-    bool lsb;
-    u8 shiftedVal;
-    u8 final_val;
+static void execute_SUB(cpu *cpu, u8 b) {
+    u8 a = cpu->A;
+    u16 res = a - b;
 
-    tick_MCycle();
-    val = fetch_data(cpu, instr.op_a);
-    lsb = bit_read(val, 0);
-    shiftedVal = 0x7F & (val >> 1);
+    cpu->A = res;
+
+    cpu->lazyZ = res;
+    cpu->lazyN = 1;
+    cpu->lazyH = a ^ b ^ res;
+    cpu->lazyC = res;
+}
 
-    final_val = shiftedVal | (lsb << 7);
+static void execute_SBC(cpu *cpu, u8 b) {
+    u8 a = cpu->A;
+    u16 res = a - b - flag_C(cpu);
 
-    write_data(cpu, instr.op_a, final_val);
-    tick_MCycle();
+    cpu->A = res;
 
-    flag_reg_write(cpu, Z, final_val == 0);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, lsb);
+    cpu->lazyZ = res;
+    cpu->lazyN = 1;
+    cpu->lazyH = a ^ b ^ res;
+    cpu->lazyC = res;
 }
 
-static void execute_RRCA(cpu *cpu) {
-    u8 val = cpu->A;
-    bool lsb = bit_read(val, 0);
-    cpu->A = (0x7F & (val >> 1)) | (lsb << 7);
+static void execute_OR(cpu *cpu, u8 data) {
+    cpu->A |= data;
 
-    bit_clear(&cpu->F, Z);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, lsb);
-    tick_MCycle();
+    flags_logic(cpu, cpu->A, 0, 0);
 }
 
-static void execute_RRA(cpu *cpu) {
-    u8 val = cpu->A;
-    bool lsb = bit_read(val, 0);
-    bool Cflag = flag_reg_read(cpu, C);
-
-    cpu->A = (val >> 1) | (Cflag << 7);
+static void execute_XOR(cpu *cpu, u8 data) {
+    cpu->A ^= data;
 
-    bit_clear(&cpu->F, Z);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, lsb);
-    tick_MCycle();
+    flags_logic(cpu, cpu->A, 0, 0);
 }
 
-static void execute_SLA(cpu *cpu, instruction instr) {
-    tick_MCycle();
-    u8 val = fetch_data(cpu, instr.op_a);
-    u8 msb = bit_read(val, 7);
-    u8 shiftedVal = val << 1;
-
-    write_data(cpu, instr.op_a, shiftedVal);
-    tick_MCycle();
+static void execute_AND(cpu *cpu, u8 data) {
+    cpu->A &= data;
 
-    flag_reg_write(cpu, Z, shiftedVal == 0);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, msb);
+    flags_logic(cpu, cpu->A, 0x10, 0);
 }
 
-static void execute_SRA(cpu *cpu, instruction instr) {
-    tick_MCycle();
-    u8 val = fetch_data(cpu, instr.op_a);
-    bool lsb = bit_read(val, 0);
-    u8 shiftedVal = (val >> 1) | (val & 0x80);
-
-    write_data(cpu, instr.op_a, shiftedVal);
-    tick_MCycle();
+static u8 execute_DEC(cpu *cpu, u8 currVal) {
+    u8 res = currVal - 1;
 
-    flag_reg_write(cpu, Z, shiftedVal == 0);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, lsb);
+    cpu->lazyZ = res;
+    cpu->lazyN = 1;
+    cpu->lazyH = currVal ^ 1 ^ res;
+    return res;
 }
 
-static void execute_SRL(cpu *cpu, instruction instr) {
-    tick_MCycle();
-    u8 val = fetch_data(cpu, instr.op_a);
-    u8 lsb = bit_read(val, 0);
-    u8 shiftedVal = val >> 1;
-
-    write_data(cpu, instr.op_a, shiftedVal);
-    tick_MCycle();
+static u8 execute_INC(cpu *cpu, u8 currVal) {
+    u8 sum = currVal + 1;
 
-    flag_reg_write(cpu, Z, shiftedVal == 0);
-    clear_NH_flags(cpu);
-    flag_reg_write(cpu, C, lsb);
+    cpu->lazyZ = sum;
+    cpu->lazyN = 0;
+    cpu->lazyH = currVal ^ 1 ^ sum;
+    return sum;
 }
 
-static void execute_ADD(cpu *cpu, instruction instr) {
+static void execute_CP(cpu *cpu, u8 data) {
     u8 regA = cpu->A;
-    u8 b = fetch_data(cpu, instr.op_b);
-
-    u8 res = regA + b;
+    u16 res = regA - data;
 
-    flag_reg_write(cpu, Z, res == 0);
-    bit_clear(&cpu->F, N);
-    flag_reg_write(cpu, H, add_isHC8(regA, b));
-    flag_reg_write(cpu, C, add_isC8(regA, b));
-
-    reg_write(cpu, REG_A, res);
+    cpu->lazyZ = res;
+    cpu->lazyN = 1;
+    cpu->lazyH = regA ^ data ^ res;
+    cpu->lazyC = res;
+}
 
-    tick_MCycle();
+static void execute_BIT(cpu *cpu, u8 idx, u8 val) {
+    cpu->lazyZ = val & (1 << idx);
+    cpu->lazyN = 0;
+    cpu->lazyH = 0x10;
 }
 
-static void execute_ADDSP(cpu *cpu) {
-    // TODO fix timing
-    tick_MCycle();
+// index of the lowest set bit, the pending interrupt with the highest priority
+static const u8 interruptIndex[0x20] = {0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0};
 
-    u16 SPval = cpu->SP;
-    u8 val = fetch_data(cpu, IM_DATA8);
-    int8 e = (int8)val;
-    u16 res = SPval + e;
+static void handle_interrupts(cpu *cpu) {
+    val16 PC;
+    u8 IE;
+    u8 IFandIE;
 
+    PC = (val16)cpu->PC;
+    // disable interrupt
+    cpu->IME = 0;
+    pending_update(cpu);
     tick_MCycle();
+    tick_MCycle();
+    // push PC to stack
+    bus_write(--cpu->SP, PC.msb, true);
+    // if the IE changes at this point, it doesn't affect the interrupt handling
+    IE = IE_register;
+    bus_write(--cpu->SP, PC.lsb, true);
 
-    bit_clear(&cpu->F, Z);
-    bit_clear(&cpu->F, N);
-    flag_reg_write(cpu, H, addSigned_isHC(SPval, e));
-    flag_reg_write(cpu, C, addSigned_isC(SPval, e));
-
-    reg_write16(cpu, REG_SP, res);
-
+    // the last 2 steps of interrupt handling is to
+    // first disable the specific interrupt(set the
+    // proper bit of IF register to 0) and then jump to
+    // interrupt address, VBLANK 0x40, LCDstat 0x48, Timer 0x50, Serial 0x58, Joypad 0x60
+    timing_catchUp();
+    IFandIE = IF_register & IE & 0x1F;
+    if (IFandIE != 0) {
+        u8 idx = interruptIndex[IFandIE];
+        bit_clear(&IF_register, idx);
+        cpu->PC = 0x0040 + idx * 8;
+    }
+    else {
+        // cancelled intr
+        cpu->PC = 0x0000;
+    }
     tick_MCycle();
 }
 
-static void execute_ADD16(cpu *cpu, instruction instr) {
-    u16 a = fetch_data(cpu, instr.op_a);
-    u16 b = fetch_data(cpu, instr.op_b);
-    u16 res = a + b;
+#ifdef TEST_CHECK
+void checkMooneyeTest(cpu *cpu, u8 opcode) {
+    if (opcode == 0x40) {
+        if (cpu->B == 3 && cpu->C == 5 && cpu->D == 8 && cpu->E == 13 && cpu->H == 21 && cpu->L == 34) {
+            printf("TEST SUCCESSFUL \n");
+            testPassed = 1;
+        }
+    }
+}
+#endif
 
-    tick_MCycle();
+static bool isReg8(instr_op op) { return op <= REG_L; }
 
-    bit_clear(&cpu->F, N);
-    flag_reg_write(cpu, H, add_isHC16(a, b));
-    flag_reg_write(cpu, C, add_isC16(a, b));
+static bool isIndirect(instr_op op) { return op == DATA_HL || op == DATA_BC || op == DATA_DE; }
 
-    reg_write16(cpu, REG_HL, res);
-
-    tick_MCycle();
+static u8 *reg8(cpu *cpu, instr_op reg) {
+    switch (reg) {
+        case REG_A:
+            return &cpu->A;
+        case REG_B:
+            return &cpu->B;
+        case REG_C:
+            return &cpu->C;
+        case REG_D:
+            return &cpu->D;
+        case REG_E:
+            return &cpu->E;
+        case REG_H:
+            return &cpu->H;
+        case REG_L:
+            return &cpu->L;
+        default:
+            printf("Attempted to decode an invalid register. \n");
+            exit(0);
+    }
 }
 
-static void execute_ADC(cpu *cpu, instruction instr) {
-    u8 a = fetch_data(cpu, instr.op_a);
-    u8 b = fetch_data(cpu, instr.op_b);
-    bool C_flag = flag_reg_read(cpu, C);
-    u8 sum = a + b + C_flag;
-
-    cpu->A = sum;
-
-    flag_reg_write(cpu, Z, sum == 0);
-    bit_clear(&cpu->F, N);
-    flag_reg_write(cpu, H, adc_isHC8(a, b, C_flag));
-    flag_reg_write(cpu, C, adc_isC8(a, b, C_flag));
-
-    tick_MCycle();
+// register pair of a 16 bit operand, or the pair that holds the address of an indirect one
+static u16 *reg16(cpu *cpu, instr_op reg) {
+    switch (reg) {
+        case REG_HL:
+        case DATA_HL:
+            return &cpu->HL;
+        case REG_BC:
+        case DATA_BC:
+            return &cpu->BC;
+        case REG_DE:
+        case DATA_DE:
+            return &cpu->DE;
+        case REG_AF:
+            return &cpu->AF;
+        case REG_SP:
+            return &cpu->SP;
+        case REG_PC:
+            return &cpu->PC;
+        default:
+            printf("Attempted to decode an invalid register. \n");
+            exit(0);
+    }
 }
 
-static void execute_SUB(cpu *cpu, instruction instr) {
-    u8 b = fetch_data(cpu, instr.op_b);
-    u8 a = cpu->A;
-    u8 res = a - b;
-
-    cpu->A = res;
-
-    flag_reg_write(cpu, Z, res == 0);
-    bit_set(&cpu->F, N);
-    flag_reg_write(cpu, H, sub_isHC8(a, b));
-    flag_reg_write(cpu, C, sub_isC8(a, b));
-
-    tick_MCycle();
+static void decodeError(u16 opcode) {
+    printf("Cannot decode opcode 0x%03X. \n", opcode);
+    exit(0);
 }
 
-static void execute_SBC(cpu *cpu, instruction instr) {
-    u8 b = fetch_data(cpu, instr.op_b);
-    u8 a = cpu->A;
-    u16 res = a - (b + flag_reg_read(cpu, C));
-
-    cpu->A = (u8)res;
+static void decode_LD(cpu *cpu, u16 opcode, instruction instr, decodedInstr *d) {
+    instr_op a = instr.op_a;
+    instr_op b = instr.op_b;
 
-    u8 HCflag = (((a & 0xF) - ((b & 0xF) + flag_reg_read(cpu, C))) & 0x10) == 0x10;
-    u8 Cflag = res > 0xFF;
-
-    flag_reg_write(cpu, Z, (u8)res == 0);
-    bit_set(&cpu->F, N);
-    flag_reg_write(cpu, H, HCflag);
-    flag_reg_write(cpu, C, Cflag);
-
-    tick_MCycle();
+    if (isReg8(a) && isReg8(b)) {
+        d->handler = OP_LD_R_R;
+        d->r = reg8(cpu, a);
+        d->r2 = reg8(cpu, b);
+    }
+    else if (isReg8(a) && b == IM_DATA8) {
+        d->handler = OP_LD_R_N;
+        d->r = reg8(cpu, a);
+    }
+    else if (isReg8(a) && isIndirect(b)) {
+        d->handler = OP_LD_R_MEM;
+        d->r = reg8(cpu, a);
+        d->rr = reg16(cpu, b);
+    }
+    else if (isIndirect(a) && isReg8(b)) {
+        d->handler = OP_LD_MEM_R;
+        d->r = reg8(cpu, b);
+        d->rr = reg16(cpu, a);
+    }
+    else if (a == DATA_HL && b == IM_DATA8)
+        d->handler = OP_LD_HL_N;
+    else if (a == REG_A && b == DATA_NN)
+        d->handler = OP_LD_A_NN;
+    else if (a == DATA_NN && b == REG_A)
+        d->handler = OP_LD_NN_A;
+    else if (a == REG_A && b == DATA_C)
+        d->handler = OP_LD_A_C;
+    else if (a == DATA_C && b == REG_A)
+        d->handler = OP_LD_C_A;
+    else if (a == REG_A && b == DATA_N)
+        d->handler = OP_LDH_A_N;
+    else if (a == DATA_N && b == REG_A)
+        d->handler = OP_LDH_N_A;
+    else if (b == IM_DATA16) {
+        d->handler = OP_LD_RR_NN;
+        d->rr = reg16(cpu, a);
+    }
+    else if (a == DATA_NN16 && b == REG_SP)
+        d->handler = OP_LD_NN_SP;
+    else
+        decodeError(opcode);
 }
 
-static void execute_OR(cpu *cpu, instruction instr) {
-    u8 data = fetch_data(cpu, instr.op_b);
-
-    cpu->A |= data;
-
-    flag_reg_write(cpu, Z, cpu->A == 0);
-    clear_NH_flags(cpu);
-    bit_clear(&cpu->F, C);
+// handlers that come in register, (HL) and immediate forms are declared in that order
+static u8 operandForm(instr_op op) { return isReg8(op) ? 0 : (op == DATA_HL) ? 1 : 2; }
 
-    tick_MCycle();
+static u8 operand_length(instr_op op) {
+    switch (op) {
+        case IM_DATA8:
+        case DATA_N:
+            return 1;
+        case IM_DATA16:
+        case DATA_NN:
+        case DATA_NN16:
+            return 2;
+        default:
+            return 0;
+    }
 }
 
-static void execute_XOR(cpu *cpu, instruction instr) {
-    u8 data = fetch_data(cpu, instr.op_b);
-
-    cpu->A ^= data;
+static decodedInstr decode(cpu *cpu, u16 opcode) {
+    instruction instr = opcode_to_instr(opcode & 0xFF, opcode > 0xFF);
+    decodedInstr d = {0};
 
-    flag_reg_write(cpu, Z, cpu->A == 0);
-    clear_NH_flags(cpu);
-    bit_clear(&cpu->F, C);
+    // the operand of RST is the vector, not an operand type
+    if (opcode > 0xFF)
+        d.length = 2;
+    else if (instr.type == RST)
+        d.length = 1;
+    else
+        d.length = 1 + operand_length(instr.op_a) + operand_length(instr.op_b);
 
-    tick_MCycle();
+    switch (instr.type) {
+        case LD:
+            decode_LD(cpu, opcode, instr, &d);
+            break;
+        case LD_SP_HL:
+            d.handler = OP_LD_SP_HL;
+            break;
+        case LDD:
+            d.handler = (instr.op_a == REG_A) ? OP_LDD_A_HL : OP_LDD_HL_A;
+            break;
+        case LDI:
+            d.handler = (instr.op_a == REG_A) ? OP_LDI_A_HL : OP_LDI_HL_A;
+            break;
+        case LDHL:
+            d.handler = OP_LDHL;
+            break;
+        case PUSH:
+            d.handler = (instr.op_a == REG_AF) ? OP_PUSH_AF : OP_PUSH;
+            d.rr = reg16(cpu, instr.op_a);
+            break;
+        case POP:
+            d.handler = (instr.op_a == REG_AF) ? OP_POP_AF : OP_POP;
+            d.rr = reg16(cpu, instr.op_a);
+            break;
+        case ADD:
+        case ADC:
+        case SUB:
+        case SBC:
+        case AND:
+        case OR:
+        case XOR:
+        case CP: {
+            static const HANDLER ALU_handlers[] = {[ADD] = OP_ADD_R, [ADC] = OP_ADC_R, [SUB] = OP_SUB_R, [SBC] = OP_SBC_R,
+                                                   [AND] = OP_AND_R, [OR] = OP_OR_R,   [XOR] = OP_XOR_R, [CP] = OP_CP_R};
+            d.handler = ALU_handlers[instr.type] + operandForm(instr.op_b);
+            if (isReg8(instr.op_b))
+                d.r = reg8(cpu, instr.op_b);
+            break;
+        }
+        case ADD16:
+            d.handler = OP_ADD16;
+            d.rr = reg16(cpu, instr.op_b);
+            break;
+        case ADDSP:
+            d.handler = OP_ADDSP;
+            break;
+        case INC:
+        case DEC:
+            d.handler = ((instr.type == INC) ? OP_INC_R : OP_DEC_R) + operandForm(instr.op_a);
+            if (isReg8(instr.op_a))
+                d.r = reg8(cpu, instr.op_a);
+            break;
+        case INC16:
+        case DEC16:
+            d.handler = (instr.type == INC16) ? OP_INC16 : OP_DEC16;
+            d.rr = reg16(cpu, instr.op_a);
+            break;
+        case DAA:
+            d.handler = OP_DAA;
+            break;
+        case CPL:
+            d.handler = OP_CPL;
+            break;
+        case CCF:
+            d.handler = OP_CCF;
+            break;
+        case SCF:
+            d.handler = OP_SCF;
+            break;
+        case NOP:
+            d.handler = OP_NOP;
+            break;
+        case HALT:
+            d.handler = OP_HALT;
+            break;
+        case STOP:
+            d.handler = OP_STOP;
+            break;
+        case DI:
+            d.handler = OP_DI;
+            break;
+        case EI:
+            d.handler = OP_EI;
+            break;
+        case RLCA:
+            d.handler = OP_SHIFT_A;
+            d.n = SHIFT_RLC;
+            break;
+        case RLA:
+            d.handler = OP_SHIFT_A;
+            d.n = SHIFT_RL;
+            break;
+        case RRCA:
+            d.handler = OP_SHIFT_A;
+            d.n = SHIFT_RRC;
+            break;
+        case RRA:
+            d.handler = OP_SHIFT_A;
+            d.n = SHIFT_RR;
+            break;
+        case JP:
+        case JR:
+        case CALL:
+        case RET: {
+            static const HANDLER jumpHandlers[] = {[JP] = OP_JP, [JR] = OP_JR, [CALL] = OP_CALL, [RET] = OP_RET};
+            static const HANDLER condHandlers[] = {[JP] = OP_JP_CC, [JR] = OP_JR_CC, [CALL] = OP_CALL_CC, [RET] = OP_RET_CC};
+
+            switch (instr.op_a) {
+                case NONE:
+                    d.handler = jumpHandlers[instr.type];
+                    break;
+                case JP_HL:
+                    d.handler = OP_JP_HL;
+                    break;
+                case JP_NZ:
+                case JP_Z:
+                case JP_NC:
+                case JP_C:
+                    d.handler = condHandlers[instr.type];
+                    d.flagMask = (instr.op_a == JP_NZ || instr.op_a == JP_Z) ? (1 << Z) : (1 << C);
+                    d.flagExpect = (instr.op_a == JP_Z || instr.op_a == JP_C) ? d.flagMask : 0;
+                    break;
+                default:
+                    decodeError(opcode);
+            }
+            break;
+        }
+        case RST:
+            d.handler = OP_RST;
+            d.n = instr.op_a;
+            break;
+        case RETI:
+            d.handler = OP_RETI;
+            break;
+        case RLC:
+        case RRC:
+        case RL:
+        case RR:
+        case SLA:
+        case SRA:
+        case SWAP:
+        case SRL: {
+            static const SHIFT_OP shiftOps[] = {[RLC] = SHIFT_RLC, [RRC] = SHIFT_RRC, [RL] = SHIFT_RL,     [RR] = SHIFT_RR,
+                                                [SLA] = SHIFT_SLA, [SRA] = SHIFT_SRA, [SWAP] = SHIFT_SWAP, [SRL] = SHIFT_SRL};
+            d.handler = OP_SHIFT_R + operandForm(instr.op_a);
+            d.n = shiftOps[instr.type];
+            if (isReg8(instr.op_a))
+                d.r = reg8(cpu, instr.op_a);
+            break;
+        }
+        case BIT:
+        case RES:
+        case SET:
+            // op_a is the index of the bit
+            d.handler = ((instr.type == BIT) ? OP_BIT_R : (instr.type == RES) ? OP_RES_R : OP_SET_R) + operandForm(instr.op_b);
+            d.n = instr.op_a;
+            if (isReg8(instr.op_b))
+                d.r = reg8(cpu, instr.op_b);
+            break;
+        default:
+            decodeError(opcode);
+    }
+    return d;
 }
 
-static void execute_AND(cpu *cpu, instruction instr) {
-    u8 data = fetch_data(cpu, instr.op_b);
-
-    cpu->A &= data;
-
-    flag_reg_write(cpu, Z, cpu->A == 0);
-    bit_clear(&cpu->F, N);
-    bit_set(&cpu->F, H);
-    bit_clear(&cpu->F, C);
-
-    tick_MCycle();
+#ifdef DEBUG
+void opcode_print(FILE *fp, u16 opcode) {
+    if (opcode > 0xFF)
+        fprintf(fp, "op code: 0xCB 0x%02X ", opcode & 0xFF);
+    else
+        fprintf(fp, "op code: 0x%02X ", opcode);
 }
 
-static void execute_DEC(cpu *cpu, instruction instr) {
-    u8 currVal = fetch_data(cpu, instr.op_a);
-    u8 res = currVal - 1;
-
-    write_data(cpu, instr.op_a, res);
-
-    flag_reg_write(cpu, Z, res == 0);
-    bit_set(&cpu->F, N);
-    flag_reg_write(cpu, H, sub_isHC8(currVal, 1));
-
-    tick_MCycle();
-}
+static u16 fetch_instruction(cpu *cpu, FILE *logFile) {
+#else
+static u16 fetch_instruction(cpu *cpu) {
+#endif
+    u16 opcode = bus_read(cpu->PC, false);
 
-static void execute_DEC16(cpu *cpu, instruction instr) {
-    tick_MCycle();
+#ifdef TEST_CHECK
+    checkMooneyeTest(cpu, opcode);
+#endif
 
-    u16 currVal = reg_read16(*cpu, instr.op_a);
-    u16 res = currVal - 1;
+    if (!cpu->isHaltBug)
+        cpu->PC++;
+    else
+        cpu->isHaltBug = false;
 
-    reg_write16(cpu, instr.op_a, res);
+    // the prefix and the CB opcode are handled as a single instruction
+    if (opcode == 0xCB)
+        opcode = 0x100 | bus_read(cpu->PC++, false);
 
-    tick_MCycle();
+#ifdef DEBUG
+    opcode_print(logFile, opcode);
+#endif
+    return opcode;
 }
 
-static void execute_INC(cpu *cpu, instruction instr) {
-    u8 currVal = fetch_data(cpu, instr.op_a);
-    u8 sum = currVal + 1;
-
-    flag_reg_write(cpu, Z, sum == 0);
-    bit_clear(&cpu->F, N);
-    flag_reg_write(cpu, H, add_isHC8(currVal, 1));
-
-    write_data(cpu, instr.op_a, sum);
-
+static void execute_JR_CC(cpu *cpu, const decodedInstr *instr) {
+    int8 e = (int8)bus_read(cpu->PC++, true);
     tick_MCycle();
+    if (cond_check(cpu, instr)) {
+        cpu->PC += e;
+        tick_MCycle();
+    }
 }
 
-static void execute_INC16(cpu *cpu, instruction instr) {
-    u16 currVal = reg_read16(*cpu, instr.op_a);
-    u16 sum = currVal + 1;
-
-    tick_MCycle();
+bool stopBlock;
 
-    reg_write16(cpu, instr.op_a, sum);
-
-    tick_MCycle();
+// anything cpu_run has to handle before the next instruction ends the block
+static bool block_canContinue(cpu *cpu) {
+    timing_catchUp();
+    // in a block isPending can only be set by an interrupt, HALT and EI end the block
+    return !stopBlock && !cpu->isPending;
 }
 
-static void execute_CP(cpu *cpu, instruction instr) {
-    u8 regA = cpu->A;
-    u8 data = fetch_data(cpu, instr.op_b);
-    u8 res = regA - data;
-
-    flag_reg_write(cpu, Z, res == 0);
-    bit_set(&cpu->F, N);
-    flag_reg_write(cpu, H, sub_isHC8(regA, data));
-    flag_reg_write(cpu, C, sub_isC8(regA, data));
-
-    tick_MCycle();
+// a fused handler checks the same between its two instructions, the second opcode is never prefixed
+static bool fused_next(cpu *cpu) {
+    if (!block_canContinue(cpu)) {
+        stopBlock = true;
+        return false;
+    }
+    cpu->PC++;
+    return true;
 }
 
-static void execute_RES(cpu *cpu, instruction instr) {
-    tick_MCycle();
+// handlers are reached through computed goto when the compiler supports it, through a switch otherwise
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
-    u8 val = fetch_data(cpu, instr.op_b);
-    u8 idx = instr.op_a;
+#ifdef COMPUTED_GOTO
+#define HANDLER_ADDR(name) [name] = &&name,
+#define FUSED_ADDR(first, second) [OP_##first##_##second] = &&OP_##first##_##second,
+#define HANDLER(name) name:
+#else
+#define HANDLER(name) case name:
+#endif
 
-    bit_clear(&val, idx);
-    write_data(cpu, instr.op_b, val);
-    tick_MCycle();
-}
+#define ALU_HANDLERS(OP)                                                                                                                                                                               \
+    HANDLER(OP_##OP##_R) {                                                                                                                                                                             \
+        execute_##OP(cpu, *instr->r);                                                                                                                                                                  \
+        tick_MCycle();                                                                                                                                                                                 \
+        return;                                                                                                                                                                                        \
+    }                                                                                                                                                                                                  \
+    HANDLER(OP_##OP##_HL) {                                                                                                                                                                            \
+        execute_##OP(cpu, bus_read(cpu->HL, true));                                                                                                                                                    \
+        tick_MCycle();                                                                                                                                                                                 \
+        return;                                                                                                                                                                                        \
+    }                                                                                                                                                                                                  \
+    HANDLER(OP_##OP##_N) {                                                                                                                                                                             \
+        execute_##OP(cpu, bus_read(cpu->PC++, true));                                                                                                                                                  \
+        tick_MCycle();                                                                                                                                                                                 \
+        return;                                                                                                                                                                                        \
+    }
 
-static void execute_SET(cpu *cpu, instruction instr) {
-    tick_MCycle();
+void execute(cpu *cpu, const decodedInstr *instr) {
+#ifdef COMPUTED_GOTO
+    static void *const handlers[NUM_HANDLERS] = {HANDLER_LIST(HANDLER_ADDR) FUSED_LIST(FUSED_ADDR)};
 
-    u8 val = fetch_data(cpu, instr.op_b);
-    u8 idx = instr.op_a;
+    goto *handlers[instr->handler];
+#else
+    switch (instr->handler) {
+#endif
 
-    bit_set(&val, idx);
-    write_data(cpu, instr.op_b, (u16)val);
+    HANDLER(OP_LD_R_R) {
+        *instr->r = *instr->r2;
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_R_N) {
+        *instr->r = bus_read(cpu->PC++, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_R_MEM) {
+        *instr->r = bus_read(*instr->rr, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_MEM_R) {
+        bus_write(*instr->rr, *instr->r, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_HL_N) {
+        u8 data = bus_read(cpu->PC++, true);
+        bus_write(cpu->HL, data, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_A_NN) {
+        u16 addr = fetch_imm16(cpu);
+        cpu->A = bus_read(addr, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_NN_A) {
+        u16 addr = fetch_imm16(cpu);
+        bus_write(addr, cpu->A, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_A_C) {
+        cpu->A = bus_read(0xFF00 + cpu->C, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_C_A) {
+        bus_write(0xFF00 + cpu->C, cpu->A, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDH_A_N) {
+        u8 offset = bus_read(cpu->PC++, true);
+        cpu->A = bus_read(0xFF00 + offset, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDH_N_A) {
+        u8 offset = bus_read(cpu->PC++, true);
+        bus_write(0xFF00 + offset, cpu->A, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDD_A_HL) {
+        cpu->A = bus_read(cpu->HL--, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDD_HL_A) {
+        bus_write(cpu->HL--, cpu->A, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDI_A_HL) {
+        cpu->A = bus_read(cpu->HL++, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDI_HL_A) {
+        bus_write(cpu->HL++, cpu->A, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_RR_NN) {
+        *instr->rr = fetch_imm16(cpu);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_SP_HL) {
+        tick_MCycle();
+        cpu->SP = cpu->HL;
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDHL) {
+        tick_MCycle();
+        int8 e = (int8)bus_read(cpu->PC++, true);
+        cpu->HL = execute_ADDSP(cpu, e);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_NN_SP) {
+        val16 SP = (val16)cpu->SP;
+        u16 addr = fetch_imm16(cpu);
+        bus_write(addr, SP.lsb, true);
+        bus_write(addr + 1, SP.msb, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_PUSH) {
+        stack_push(cpu, *instr->rr);
+        return;
+    }
+    HANDLER(OP_PUSH_AF) {
+        cpu->F = flags_read(cpu);
+        stack_push(cpu, cpu->AF);
+        return;
+    }
+    HANDLER(OP_POP) {
+        *instr->rr = stack_pop(cpu);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_POP_AF) {
+        // 4 lsbs are always 0 in register F
+        cpu->AF = stack_pop(cpu) & 0xFFF0;
+        flags_write(cpu, cpu->F);
+        tick_MCycle();
+        return;
+    }
 
-    tick_MCycle();
-}
+    ALU_HANDLERS(ADD)
+    ALU_HANDLERS(ADC)
+    ALU_HANDLERS(SUB)
+    ALU_HANDLERS(SBC)
+    ALU_HANDLERS(AND)
+    ALU_HANDLERS(OR)
+    ALU_HANDLERS(XOR)
+    ALU_HANDLERS(CP)
+
+    HANDLER(OP_ADD16) {
+        u16 res = execute_ADD16(cpu, cpu->HL, *instr->rr);
+        tick_MCycle();
+        cpu->HL = res;
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_ADDSP) {
+        // TODO fix timing
+        tick_MCycle();
+        int8 e = (int8)bus_read(cpu->PC++, true);
+        tick_MCycle();
+        cpu->SP = execute_ADDSP(cpu, e);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_INC_R) {
+        *instr->r = execute_INC(cpu, *instr->r);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_INC_HL) {
+        u8 val = bus_read(cpu->HL, true);
+        bus_write(cpu->HL, execute_INC(cpu, val), true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_DEC_R) {
+        *instr->r = execute_DEC(cpu, *instr->r);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_DEC_HL) {
+        u8 val = bus_read(cpu->HL, true);
+        bus_write(cpu->HL, execute_DEC(cpu, val), true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_INC16) {
+        (*instr->rr)++;
+        tick_MCycle();
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_DEC16) {
+        (*instr->rr)--;
+        tick_MCycle();
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_DAA) {
+        execute_DAA(cpu);
+        return;
+    }
+    HANDLER(OP_CPL) {
+        execute_CPL(cpu);
+        return;
+    }
+    HANDLER(OP_CCF) {
+        execute_CCF(cpu);
+        return;
+    }
+    HANDLER(OP_SCF) {
+        execute_SCF(cpu);
+        return;
+    }
+    HANDLER(OP_NOP) {
+        execute_NOP();
+        return;
+    }
+    HANDLER(OP_HALT) {
+        execute_HALT(cpu);
+        return;
+    }
+    HANDLER(OP_STOP) {
+        execute_STOP();
+        return;
+    }
+    HANDLER(OP_DI) {
+        execute_DI(cpu);
+        return;
+    }
+    HANDLER(OP_EI) {
+        execute_EI(cpu);
+        return;
+    }
+    HANDLER(OP_SHIFT_A) {
+        execute_shiftA(cpu, instr->n);
+        return;
+    }
+    HANDLER(OP_JP) {
+        u16 nn = fetch_imm16(cpu);
+        tick_MCycle();
+        cpu->PC = nn;
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_JP_CC) {
+        u16 nn = fetch_imm16(cpu);
+        tick_MCycle();
+        if (cond_check(cpu, instr)) {
+            cpu->PC = nn;
+            tick_MCycle();
+        }
+        return;
+    }
+    HANDLER(OP_JP_HL) {
+        tick_MCycle();
+        cpu->PC = cpu->HL;
+        return;
+    }
+    HANDLER(OP_JR) {
+        int8 e = (int8)bus_read(cpu->PC++, true);
+        tick_MCycle();
+        cpu->PC += e;
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_JR_CC) {
+        execute_JR_CC(cpu, instr);
+        return;
+    }
+    HANDLER(OP_CALL) {
+        u16 nn = fetch_imm16(cpu);
+        stack_push(cpu, cpu->PC);
+        cpu->PC = nn;
+        return;
+    }
+    HANDLER(OP_CALL_CC) {
+        u16 nn = fetch_imm16(cpu);
+        if (cond_check(cpu, instr)) {
+            stack_push(cpu, cpu->PC);
+            cpu->PC = nn;
+        }
+        else
+            tick_MCycle();
+        return;
+    }
+    HANDLER(OP_RST) {
+        stack_push(cpu, cpu->PC);
+        cpu->PC = instr->n;
+        return;
+    }
+    HANDLER(OP_RET) {
+        cpu->PC = stack_pop(cpu);
+        tick_MCycle();
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_RET_CC) {
+        if (cond_check(cpu, instr)) {
+            tick_MCycle();
+            cpu->PC = stack_pop(cpu);
+        }
+        tick_MCycle();
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_RETI) {
+        cpu->PC = stack_pop(cpu);
+        tick_MCycle();
+        cpu->IME = true;
+        pending_update(cpu);
+        tick_MCycle();
+        return;
+    }
 
-static void execute_BIT(cpu *cpu, instruction instr) {
-    tick_MCycle();
+    HANDLER(OP_SHIFT_R) {
+        tick_MCycle();
+        *instr->r = execute_shift(cpu, instr->n, *instr->r);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_SHIFT_HL) {
+        tick_MCycle();
+        u8 val = bus_read(cpu->HL, true);
+        bus_write(cpu->HL, execute_shift(cpu, instr->n, val), true);
+        tick_MCycle();
+        return;
+    }
 
-    u8 val = fetch_data(cpu, instr.op_b);
-    u8 idx = instr.op_a;
+    HANDLER(OP_BIT_R) {
+        tick_MCycle();
+        tick_MCycle();
+        execute_BIT(cpu, instr->n, *instr->r);
+        return;
+    }
+    HANDLER(OP_BIT_HL) {
+        tick_MCycle();
+        u8 val = bus_read(cpu->HL, true);
+        tick_MCycle();
+        execute_BIT(cpu, instr->n, val);
+        return;
+    }
+    HANDLER(OP_RES_R) {
+        tick_MCycle();
+        bit_clear(instr->r, instr->n);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_RES_HL) {
+        tick_MCycle();
+        u8 val = bus_read(cpu->HL, true);
+        bit_clear(&val, instr->n);
+        bus_write(cpu->HL, val, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_SET_R) {
+        tick_MCycle();
+        bit_set(instr->r, instr->n);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_SET_HL) {
+        tick_MCycle();
+        u8 val = bus_read(cpu->HL, true);
+        bit_set(&val, instr->n);
+        bus_write(cpu->HL, val, true);
+        tick_MCycle();
+        return;
+    }
 
-    tick_MCycle();
+    // fused pairs, every bus access and M cycle happens as it would with the two handlers
+    HANDLER(OP_LDI_A_HL_LD_MEM_R) {
+        cpu->A = bus_read(cpu->HL++, true);
+        tick_MCycle();
+        if (!fused_next(cpu))
+            return;
+        bus_write(*instr[1].rr, *instr[1].r, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_R_MEM_LDI_HL_A) {
+        *instr->r = bus_read(*instr->rr, true);
+        tick_MCycle();
+        if (!fused_next(cpu))
+            return;
+        bus_write(cpu->HL++, cpu->A, true);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_MEM_R_INC16) {
+        bus_write(*instr->rr, *instr->r, true);
+        tick_MCycle();
+        if (!fused_next(cpu))
+            return;
+        (*instr[1].rr)++;
+        tick_MCycle();
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDI_HL_A_DEC_R) {
+        bus_write(cpu->HL++, cpu->A, true);
+        tick_MCycle();
+        if (!fused_next(cpu))
+            return;
+        *instr[1].r = execute_DEC(cpu, *instr[1].r);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_DEC16_LD_R_R) {
+        (*instr->rr)--;
+        tick_MCycle();
+        tick_MCycle();
+        if (!fused_next(cpu))
+            return;
+        *instr[1].r = *instr[1].r2;
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LD_R_R_OR_R) {
+        *instr->r = *instr->r2;
+        tick_MCycle();
+        if (!fused_next(cpu))
+            return;
+        execute_OR(cpu, *instr[1].r);
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_LDH_A_N_CP_N) {
+        u8 offset = bus_read(cpu->PC++, true);
+        cpu->A = bus_read(0xFF00 + offset, true);
+        tick_MCycle();
+        if (!fused_next(cpu))
+            return;
+        execute_CP(cpu, bus_read(cpu->PC++, true));
+        tick_MCycle();
+        return;
+    }
+    HANDLER(OP_DEC_R_JR_CC) {
+        *instr->r = execute_DEC(cpu, *instr->r);
+        tick_MCycle();
+        if (fused_next(cpu))
+            execute_JR_CC(cpu, &instr[1]);
+        return;
+    }
+    HANDLER(OP_OR_R_JR_CC) {
+        execute_OR(cpu, *instr->r);
+        tick_MCycle();
+        if (fused_next(cpu))
+            execute_JR_CC(cpu, &instr[1]);
+        return;
+    }
+    HANDLER(OP_CP_N_JR_CC) {
+        execute_CP(cpu, bus_read(cpu->PC++, true));
+        tick_MCycle();
+        if (fused_next(cpu))
+            execute_JR_CC(cpu, &instr[1]);
+        return;
+    }
+    HANDLER(OP_AND_N_JR_CC) {
+        execute_AND(cpu, bus_read(cpu->PC++, true));
+        tick_MCycle();
+        if (fused_next(cpu))
+            execute_JR_CC(cpu, &instr[1]);
+        return;
+    }
+    HANDLER(OP_BIT_R_JR_CC) {
+        tick_MCycle();
+        tick_MCycle();
+        execute_BIT(cpu, instr->n, *instr->r);
+        if (fused_next(cpu))
+            execute_JR_CC(cpu, &instr[1]);
+        return;
+    }
+#ifndef COMPUTED_GOTO
+    }
+#endif
+};
 
-    flag_reg_write(cpu, Z, !bit_read(val, idx));
-    bit_clear(&cpu->F, N);
-    bit_set(&cpu->F, H);
+static u8 fused_handler(u8 first, u8 second) {
+#define FUSED_MATCH(a, b)                                                                                                                                                                              \
+    if (first == OP_##a && second == OP_##b)                                                                                                                                                           \
+        return OP_##a##_##b;
+    FUSED_LIST(FUSED_MATCH)
+    return NUM_HANDLERS;
 }
 
-// TODO refactor
-static u16 execute_LD(cpu *cpu, instruction instr) {
-    u16 data;
-    u8 u8_data;
-    int8 int8_data;
-    switch (instr.type) {
-        case LD:
-            data = fetch_data(cpu, instr.op_b);
-            write_data(cpu, instr.op_a, data);
-
-            tick_MCycle();
-            break;
-        case LD_SP_HL:
-            tick_MCycle();
+#ifdef PROFILE_PAIRS
+// how often each opcode ran right after another one, CB prefixed opcodes are 0x100 | opcode
+#define NO_OPCODE 0xCB
 
-            data = fetch_data(cpu, instr.op_b);
-            write_data(cpu, instr.op_a, data);
+static u64 pairCounts[0x200][0x200];
+static u16 prevOpcode = NO_OPCODE;
 
-            tick_MCycle();
-            break;
-        case LDD:
-            data = fetch_data(cpu, instr.op_b);
-            write_data(cpu, instr.op_a, data);
-            (*(u16 *)(&cpu->L))--;
+static void profile_count(u16 opcode) {
+    if (prevOpcode != NO_OPCODE)
+        pairCounts[prevOpcode][opcode]++;
+    prevOpcode = opcode;
+}
 
-            tick_MCycle();
-            break;
-        case LDI:
-            data = fetch_data(cpu, instr.op_b);
-            write_data(cpu, instr.op_a, data);
-            (*(u16 *)(&cpu->L))++;
+// one "FIRST SECOND COUNT" line per pair that ran, tools/fusion.py turns the files into fusion.h
+void cpu_savePairCounts(const char *path) {
+    FILE *fp = fopen(path, "w");
 
-            tick_MCycle();
-            break;
-        case LDHL: {
-            tick_MCycle();
-            data = fetch_data(cpu, IM_DATA8);
-            u8_data = (u8)data;
-            int8_data = (int8)u8_data;
+    if (fp == NULL) {
+        printf("Couldn't write the pair counts to %s \n", path);
+        return;
+    }
+    for (u16 first = 0; first < 0x200; first++) {
+        for (u16 second = 0; second < 0x200; second++) {
+            if (pairCounts[first][second] != 0)
+                fprintf(fp, "%03X %03X %llu\n", first, second, (unsigned long long)pairCounts[first][second]);
+        }
+    }
+    fclose(fp);
+}
+#endif
 
-            u16 val_SP = cpu->SP;
-            u16 fdata = int8_data + val_SP;
-            write_data(cpu, REG_HL, fdata);
+block blockCache[1 << BLOCK_CACHE_BITS];
+// bumped every time code in a RAM page gets overwritten
+static u32 codeGen[0x100];
+static bool blockCacheEnabled = true;
 
-            bit_clear(&cpu->F, Z);
-            bit_clear(&cpu->F, N);
-            flag_reg_write(cpu, H, addSigned_isHC(val_SP, int8_data));
-            flag_reg_write(cpu, C, addSigned_isC(val_SP, int8_data));
+void cpu_invalidateCode(u8 page) {
+    codeGen[page]++;
+    stopBlock = true;
+}
 
-            tick_MCycle();
-            break;
-        }
-        default:
-            printf("Invalid LD type %d \n", instr.type);
-            exit(9);
-    }
-    return 0;
-};
+void cpu_endBlock() { stopBlock = true; }
 
-static void execute_JP(cpu *cpu, instruction instr) {
-    u16 nn = fetch_data(cpu, instr.op_b);
-    switch (instr.op_a) {
-        case NONE:
-            tick_MCycle();
-            reg_write16(cpu, REG_PC, nn);
-            tick_MCycle();
-            break;
-        case JP_HL:
-            tick_MCycle();
-            reg_write16(cpu, REG_PC, nn);
-            break;
-        case JP_NZ:
-            tick_MCycle();
-            if (!flag_reg_read(cpu, Z)) {
-                reg_write16(cpu, REG_PC, nn);
-                tick_MCycle();
-            }
-            break;
-        case JP_Z:
-            tick_MCycle();
-            if (flag_reg_read(cpu, Z)) {
-                reg_write16(cpu, REG_PC, nn);
-                tick_MCycle();
-            }
-            break;
-        case JP_NC:
-            tick_MCycle();
-            if (!flag_reg_read(cpu, C)) {
-                reg_write16(cpu, REG_PC, nn);
-                tick_MCycle();
-            }
-            break;
-        case JP_C:
-            tick_MCycle();
-            if (flag_reg_read(cpu, C)) {
-                reg_write16(cpu, REG_PC, nn);
-                tick_MCycle();
-            }
-            break;
-        default:
-            printf("Invalid JP operator %d \n", instr.op_a);
-            exit(9);
+void cpu_useBlockCache(bool enabled) { blockCacheEnabled = enabled; }
+
+#ifdef JIT
+static bool jitEnabled = true;
+#endif
+
+void cpu_useRecompiler(bool enabled) {
+#ifdef JIT
+    jitEnabled = enabled;
+#endif
+}
+
+// idle loops only read memory that can't change before the next event, once one iteration
+// leaves the registers as they were the following ones are skipped up to that event
+#define MAX_IDLE_RULES 32
+
+static u16 allowedLoops[MAX_IDLE_RULES];
+static u16 deniedLoops[MAX_IDLE_RULES];
+static u8 numAllowedLoops;
+static u8 numDeniedLoops;
+static u64 idleCycles;
+
+// the list is optional, one "allow ADDR" or "deny ADDR" per line with ADDR in hex
+void cpu_loadIdleLoopList(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char rule[6];
+    u16 addr;
+
+    if (fp == NULL)
+        return;
+
+    while (fscanf(fp, "%5s %hx", rule, &addr) == 2) {
+        if (strcmp(rule, "allow") == 0 && numAllowedLoops < MAX_IDLE_RULES)
+            allowedLoops[numAllowedLoops++] = addr;
+        else if (strcmp(rule, "deny") == 0 && numDeniedLoops < MAX_IDLE_RULES)
+            deniedLoops[numDeniedLoops++] = addr;
+        else {
+            printf("Invalid idle loop rule: %s %04X \n", rule, addr);
+            exit(0);
+        }
     }
+    fclose(fp);
 }
 
-static void execute_JR(cpu *cpu, instruction instr) {
-    int8 data = (int8)bus_read(cpu->PC++, true);
-    u16 curr_addr = reg_read16(*cpu, REG_PC);
-    tick_MCycle();
+u64 cpu_idleCycles() { return idleCycles; }
 
-    switch (instr.op_a) {
-        case NONE:
-            reg_write16(cpu, REG_PC, curr_addr + data);
-            tick_MCycle();
-            break;
-        case JP_NZ:
-            if (!flag_reg_read(cpu, Z)) {
-                reg_write16(cpu, REG_PC, curr_addr + data);
-                tick_MCycle();
-            }
-            break;
-        case JP_Z:
-            if (flag_reg_read(cpu, Z)) {
-                reg_write16(cpu, REG_PC, curr_addr + data);
-                tick_MCycle();
-            }
-            break;
-        case JP_NC:
-            if (!flag_reg_read(cpu, C)) {
-                reg_write16(cpu, REG_PC, curr_addr + data);
-                tick_MCycle();
-            }
-            break;
-        case JP_C:
-            if (flag_reg_read(cpu, C)) {
-                reg_write16(cpu, REG_PC, curr_addr + data);
-                tick_MCycle();
-            }
-            break;
-        default:
-            printf("Non valid JR instruction. \n");
-            break;
+static bool idle_isListed(const u16 *loops, u8 numLoops, u16 addr) {
+    for (u8 i = 0; i < numLoops; i++) {
+        if (loops[i] == addr)
+            return true;
     }
+    return false;
 }
 
-static void execute_CALL(cpu *cpu, instruction instr) {
-    u16 next_addr = fetch_data(cpu, IM_DATA16);
+// denied loops are never skipped, once a loop is allowed only the allowed ones are
+static bool idle_isAllowed(u16 addr) {
+    if (idle_isListed(deniedLoops, numDeniedLoops, addr))
+        return false;
+    return numAllowedLoops == 0 || idle_isListed(allowedLoops, numAllowedLoops, addr);
+}
 
-    switch (instr.op_a) {
-        case NONE:
-            stack_push(cpu, REG_PC);
-            reg_write16(cpu, REG_PC, next_addr);
-            break;
-        case JP_NZ:
-            if (!flag_reg_read(cpu, Z)) {
-                stack_push(cpu, REG_PC);
-                reg_write16(cpu, REG_PC, next_addr);
-            }
-            else
-                tick_MCycle();
-            break;
-        case JP_Z:
-            if (flag_reg_read(cpu, Z)) {
-                stack_push(cpu, REG_PC);
-                reg_write16(cpu, REG_PC, next_addr);
-            }
-            else
-                tick_MCycle();
-            break;
-        case JP_NC:
-            if (!flag_reg_read(cpu, C)) {
-                stack_push(cpu, REG_PC);
-                reg_write16(cpu, REG_PC, next_addr);
-            }
-            else
-                tick_MCycle();
-            break;
-        case JP_C:
-            if (flag_reg_read(cpu, C)) {
-                stack_push(cpu, REG_PC);
-                reg_write16(cpu, REG_PC, next_addr);
-            }
-            else
-                tick_MCycle();
-            break;
+static bool idle_isReadAllowed(u16 addr) {
+    // DIV, both of its bytes, and TIMA count on their own
+    if (addr == 0xFF03 || addr == 0xFF04 || addr == 0xFF05)
+        return false;
+    // reading the unusable areas prints an error
+    return !(addr >= 0xE000 && addr < 0xFE00) && !(addr >= 0xFEA0 && addr < 0xFF00);
+}
+
+// the instructions of an idle loop only write A and the flags, so the registers that hold an address don't change
+static bool idle_isSafe(cpu *cpu, const decodedInstr *instr, const u8 *bytes, u16 addr, u16 loopAddr) {
+    switch (instr->handler) {
+        case OP_LD_R_R:
+        case OP_LD_R_N:
+        case OP_LD_R_MEM:
+        case OP_INC_R:
+        case OP_DEC_R:
+        case OP_SHIFT_R:
+        case OP_RES_R:
+        case OP_SET_R:
+            return instr->r == &cpu->A;
+        case OP_ADD_R:
+        case OP_ADD_HL:
+        case OP_ADD_N:
+        case OP_ADC_R:
+        case OP_ADC_HL:
+        case OP_ADC_N:
+        case OP_SUB_R:
+        case OP_SUB_HL:
+        case OP_SUB_N:
+        case OP_SBC_R:
+        case OP_SBC_HL:
+        case OP_SBC_N:
+        case OP_AND_R:
+        case OP_AND_HL:
+        case OP_AND_N:
+        case OP_OR_R:
+        case OP_OR_HL:
+        case OP_OR_N:
+        case OP_XOR_R:
+        case OP_XOR_HL:
+        case OP_XOR_N:
+        case OP_CP_R:
+        case OP_CP_HL:
+        case OP_CP_N:
+        case OP_BIT_R:
+        case OP_BIT_HL:
+        case OP_LD_A_C:
+        case OP_DAA:
+        case OP_CPL:
+        case OP_CCF:
+        case OP_SCF:
+        case OP_NOP:
+        case OP_SHIFT_A:
+            return true;
+        case OP_LDH_A_N:
+            return idle_isReadAllowed(0xFF00 + bytes[1]);
+        case OP_LD_A_NN:
+            return idle_isReadAllowed(bytes[1] | (bytes[2] << 8));
+        case OP_JR:
+        case OP_JR_CC:
+            return (u16)(addr + 2 + (int8)bytes[1]) == loopAddr;
+        case OP_JP:
+        case OP_JP_CC:
+            return (bytes[1] | (bytes[2] << 8)) == loopAddr;
         default:
-            printf("Invalid CALL operand %d \n", instr.op_a);
-            exit(0);
+            return false;
     }
 }
 
-static void execute_RST(cpu *cpu, instruction instr) {
-    stack_push(cpu, REG_PC);
-    reg_write16(cpu, REG_PC, instr.op_a);
+// loops are only skipped outside of the trace
+#ifndef DEBUG
+// last completed iteration of an idle loop
+static struct {
+    const block *b;
+    cpu regs;
+    u64 endCycle;
+    u64 nextEvent;
+} idleLoop;
+
+// addresses read through a register pair or through C
+static bool idle_instrReadAllowed(cpu *cpu, const decodedInstr *instr) {
+    switch (instr->handler) {
+        case OP_LD_R_MEM:
+            return idle_isReadAllowed(*instr->rr);
+        case OP_LD_A_C:
+            return idle_isReadAllowed(0xFF00 + cpu->C);
+        case OP_ADD_HL:
+        case OP_ADC_HL:
+        case OP_SUB_HL:
+        case OP_SBC_HL:
+        case OP_AND_HL:
+        case OP_OR_HL:
+        case OP_XOR_HL:
+        case OP_CP_HL:
+        case OP_BIT_HL:
+            return idle_isReadAllowed(cpu->HL);
+        default:
+            return true;
+    }
 }
 
-static void execute_RETI(cpu *cpu) {
-    stack_pop(cpu, REG_PC);
-    tick_MCycle();
-    cpu->IME = true;
-    tick_MCycle();
-}
+static bool idle_readsAllowed(cpu *cpu, const block *b) {
+    for (u8 i = 0; i < b->numInstrs; i++) {
+        u16 opcode = b->opcodes[i];
 
-static void execute_RET(cpu *cpu, instruction instr) {
-    switch (instr.op_a) {
-        case NONE:
-            stack_pop(cpu, REG_PC);
-            tick_MCycle();
-            tick_MCycle();
-            break;
-        case JP_NZ:
-            if (!flag_reg_read(cpu, Z)) {
-                tick_MCycle();
-                stack_pop(cpu, REG_PC);
-            }
-            tick_MCycle();
-            tick_MCycle();
-            break;
-        case JP_Z:
-            if (flag_reg_read(cpu, Z)) {
-                tick_MCycle();
-                stack_pop(cpu, REG_PC);
-            }
-            tick_MCycle();
-            tick_MCycle();
-            break;
-        case JP_NC:
-            if (!flag_reg_read(cpu, C)) {
-                tick_MCycle();
-                stack_pop(cpu, REG_PC);
-            }
-            tick_MCycle();
-            tick_MCycle();
-            break;
-        case JP_C:
-            if (flag_reg_read(cpu, C)) {
-                tick_MCycle();
-                stack_pop(cpu, REG_PC);
-            }
-            tick_MCycle();
-            tick_MCycle();
-            break;
-        default:
-            printf("Invalid RET instruction \n");
-            exit(0);
+        if (opcode < FUSED_OPCODE) {
+            if (!idle_instrReadAllowed(cpu, &decodedInstrs[opcode]))
+                return false;
+        }
+        else {
+            // the fused handler replaced the handler of the first instruction
+            const fusedInstr *fused = &fusedInstrs[opcode - FUSED_OPCODE];
+            if (!idle_instrReadAllowed(cpu, &decodedInstrs[fused->opcodes[0]]) || !idle_instrReadAllowed(cpu, &fused->instrs[1]))
+                return false;
+        }
     }
+    return true;
 }
 
-static void handle_interrupts(cpu *cpu) {
-    val16 PC;
-    u8 IE;
-    u8 IFandIE;
+static void idle_skip(cpu *cpu, const block *b, u64 startCycle) {
+    // the previous iteration ended where this one started, no event ran in between and the registers didn't change
+    bool isIdle = idleLoop.b == b && idleLoop.endCycle == startCycle && idleLoop.nextEvent == nextEventCycle && memcmp(&idleLoop.regs, cpu, sizeof(*cpu)) == 0;
 
-    PC = (val16)cpu->PC;
-    // disable interrupt
-    cpu->IME = 0;
-    tick_MCycle();
-    tick_MCycle();
-    // push PC to stack
-    bus_write(--cpu->SP, PC.msb, true);
-    // if the IE changes at this point, it doesn't affect the interrupt handling
-    IE = IE_register;
-    bus_write(--cpu->SP, PC.lsb, true);
+    idleLoop.b = b;
+    idleLoop.regs = *cpu;
+    idleLoop.nextEvent = nextEventCycle;
 
-    // if - else if to achieve interrupt priority
-    // the last 2 steps of interrupt handling is to
-    // first disable the specific interrupt(set the
-    // proper bit of IF register to 0) and then jump to
-    // interrupt address
-    // TODO use builtin functions to find highest set bit
-    IFandIE = IF_register & IE;
-    if (bit_read(IFandIE, 0)) {
-        // VBLANK interrupt
-        bit_clear(&IF_register, 0);
-        reg_write16(cpu, REG_PC, 0x0040);
-    }
-    else if (bit_read(IFandIE, 1)) {
-        // LCDstat interrupt
-        bit_clear(&IF_register, 1);
-        reg_write16(cpu, REG_PC, 0x0048);
-    }
-    else if (bit_read(IFandIE, 2)) {
-        // Timer Interrupt
-        bit_clear(&IF_register, 2);
-        reg_write16(cpu, REG_PC, 0x0050);
-    }
-    else if (bit_read(IFandIE, 3)) {
-        // Serial interrupt
-        bit_clear(&IF_register, 3);
-        reg_write16(cpu, REG_PC, 0x0058);
-    }
-    else if (bit_read(IFandIE, 4)) {
-        // Joypad interrupt
-        bit_clear(&IF_register, 4);
-        reg_write16(cpu, REG_PC, 0x0060);
+    // a pending interrupt is taken right after this iteration
+    bool isInterruptPending = cpu->isPending;
+
+    if (isIdle && !isInterruptPending && nextEventCycle != NO_EVENT && idle_readsAllowed(cpu, b)) {
+        // every iteration that ends before the next event would leave everything as it is
+        u64 iterationCycles = masterCycles - startCycle;
+        u64 skip = (nextEventCycle - 1 - masterCycles) / iterationCycles * iterationCycles;
+
+        masterCycles += skip;
+        idleCycles += skip;
     }
-    else {
-        // cancelled intr
-        reg_write16(cpu, REG_PC, 0x0000);
+    idleLoop.endCycle = masterCycles;
+}
+#endif
+
+// a block ends after any instruction that can change the PC or the interrupt state
+static bool block_isLast(const decodedInstr *instr) {
+    switch (instr->handler) {
+        case OP_JP:
+        case OP_JP_CC:
+        case OP_JP_HL:
+        case OP_JR:
+        case OP_JR_CC:
+        case OP_CALL:
+        case OP_CALL_CC:
+        case OP_RST:
+        case OP_RET:
+        case OP_RET_CC:
+        case OP_RETI:
+        case OP_HALT:
+        case OP_STOP:
+        case OP_DI:
+        case OP_EI:
+            return true;
+        default:
+            return false;
     }
-    tick_MCycle();
 }
 
+#if !defined(DEBUG) && !defined(PROFILE_PAIRS)
+static u16 fusion_find(u16 first, u16 second) {
 #ifdef TEST_CHECK
-static void checkMooneyeTest(cpu *cpu, u8 opcode) {
-    if (opcode == 0x40) {
-        if (cpu->B == 3 && cpu->C == 5 && cpu->D == 8 && cpu->E == 13 && cpu->H == 21 && cpu->L == 34) {
-            printf("TEST SUCCESSFUL \n");
-            testPassed = 1;
+    // the test breakpoint is checked before every instruction
+    if (first == 0x40 || second == 0x40)
+        return NO_FUSION;
+#endif
+    for (u16 i = 0; i < numFusedInstrs; i++) {
+        if (fusedInstrs[i].opcodes[0] == first && fusedInstrs[i].opcodes[1] == second)
+            return FUSED_OPCODE + i;
+    }
+    return NO_FUSION;
+}
+
+// adjacent instructions that form a fused pair share one entry
+static void block_fuse(block *b) {
+    u8 numInstrs = 0;
+
+    for (u8 i = 0; i < b->numInstrs; i++) {
+        u16 fused = (i + 1 < b->numInstrs) ? fusion_find(b->opcodes[i], b->opcodes[i + 1]) : NO_FUSION;
+
+        if (fused != NO_FUSION) {
+            b->opcodes[numInstrs++] = fused;
+            i++;
         }
+        else
+            b->opcodes[numInstrs++] = b->opcodes[i];
     }
+    b->numInstrs = numInstrs;
 }
 #endif
 
+// blocks never leave the page they start in
+static bool block_contains(u8 page, u16 addr) { return (addr >> 8) == page && bus_codePointer(addr) != NULL; }
+
+static void block_build(cpu *cpu, block *b, const u8 *code, u16 addr) {
+    u8 page = addr >> 8;
+    u16 offset = 0;
+    bool isIdleLoop = idle_isAllowed(addr);
+
+    b->code = code;
+    b->gen = codeGen[page];
+    b->addr = addr;
+    b->numInstrs = 0;
+#ifdef JIT
+    b->native = NULL;
+    b->numRuns = 0;
+#endif
+
+    while (b->numInstrs < BLOCK_MAX_INSTRS && block_contains(page, addr + offset)) {
+        u16 opcode = code[offset];
+        if (opcode == 0xCB) {
+            if (!block_contains(page, addr + offset + 1))
+                break;
+            opcode = 0x100 | code[offset + 1];
+        }
+
+        const decodedInstr *instr = &decodedInstrs[opcode];
+        if (!block_contains(page, addr + offset + instr->length - 1))
+            break;
+
+        b->opcodes[b->numInstrs++] = opcode;
+        isIdleLoop = isIdleLoop && idle_isSafe(cpu, instr, &code[offset], addr + offset, addr);
+        offset += instr->length;
+        if (block_isLast(instr))
+            break;
+    }
+    // a loop always ends with its jump
+    b->isIdleLoop = isIdleLoop && b->numInstrs != 0 && block_isLast(&decodedInstrs[b->opcodes[b->numInstrs - 1]]);
+    // the trace and the pair counts need every instruction on its own
+#if !defined(DEBUG) && !defined(PROFILE_PAIRS)
+    block_fuse(b);
+#endif
+
+    // from now on writes to the page must invalidate its blocks
+    if (b->numInstrs != 0)
+        bus_watchCode(page);
+}
+
+static block *block_lookup(cpu *cpu) {
+    const u8 *code = bus_codePointer(cpu->PC);
+    if (code == NULL)
+        return NULL;
+
+    block *b = &blockCache[((u32)(uintptr_t)code * 2654435761u) >> (32 - BLOCK_CACHE_BITS)];
+    if (b->code != code || b->gen != codeGen[cpu->PC >> 8])
+        block_build(cpu, b, code, cpu->PC);
+
+    return (b->numInstrs != 0) ? b : NULL;
+}
+
 #ifdef DEBUG
-static instruction fetch_instruction(cpu *cpu, FILE *logFile) {
+static void block_run(cpu *cpu, block *b, FILE *logFile) {
 #else
-static instruction fetch_instruction(cpu *cpu) {
+static void block_run(cpu *cpu, block *b) {
 #endif
-    u8 opcode = bus_read(cpu->PC, false);
-
-#ifdef TEST_CHECK
-    checkMooneyeTest(cpu, opcode);
+#ifndef DEBUG
+    u64 startCycle = masterCycles;
 #endif
 
-    if (!cpu->isHaltBug)
-        cpu->PC++;
-    else
-        cpu->isHaltBug = false;
+    stopBlock = false;
 
-    instruction instr = opcode_to_instr(opcode, cpu->isCB);
+#ifdef JIT
+    if (b->native == NULL && jitEnabled && b->addr < 0x8000 && ++b->numRuns == JIT_THRESHOLD)
+        jitEnabled = block_compile(cpu, b);
+
+    // the recompiled code exits wherever the loop below would return
+    if (b->native != NULL) {
 #ifdef DEBUG
-    fprintf(logFile, "op code: 0x%02X ", opcode);
+        jitLogFile = logFile;
 #endif
-    return instr;
-}
-
-static void execute(cpu *cpu, instruction instr) {
-    if (!cpu->isCB) {
-        switch (instr.type) {
-            case LD:
-            case LD_SP_HL:
-            case LDD:
-            case LDI:
-            case LDHL:
-                execute_LD(cpu, instr);
-                break;
-            case PUSH:
-                stack_push(cpu, instr.op_a);
-                break;
-            case POP:
-                stack_pop(cpu, instr.op_a);
-                tick_MCycle();
-                break;
-            case ADD16:
-                execute_ADD16(cpu, instr);
-                break;
-            case ADD:
-                execute_ADD(cpu, instr);
-                break;
-            case ADC:
-                execute_ADC(cpu, instr);
-                break;
-            case SUB:
-                execute_SUB(cpu, instr);
-                break;
-            case SBC:
-                execute_SBC(cpu, instr);
-                break;
-            case AND:
-                execute_AND(cpu, instr);
-                break;
-            case OR:
-                execute_OR(cpu, instr);
-                break;
-            case XOR:
-                execute_XOR(cpu, instr);
-                break;
-            case CP:
-                execute_CP(cpu, instr);
-                break;
-            case INC16:
-                execute_INC16(cpu, instr);
-                break;
-            case INC:
-                execute_INC(cpu, instr);
-                break;
-            case DEC16:
-                execute_DEC16(cpu, instr);
-                break;
-            case DEC:
-                execute_DEC(cpu, instr);
-                break;
-            case DAA:
-                execute_DAA(cpu);
-                break;
-            case CPL:
-                execute_CPL(cpu);
-                break;
-            case CCF:
-                execute_CCF(cpu);
-                break;
-            case SCF:
-                execute_SCF(cpu);
-                break;
-            case NOP:
-                execute_NOP();
-                break;
-            case HALT:
-                execute_HALT(cpu);
-                break;
-            case STOP:
-                execute_STOP();
-                break;
-            case DI:
-                execute_DI(cpu);
-                break;
-            case EI:
-                execute_EI(cpu);
-                break;
-            case RLCA:
-                execute_RLCA(cpu);
-                break;
-            case RLA:
-                execute_RLA(cpu);
-                break;
-            case RRCA:
-                execute_RRCA(cpu);
-                break;
-            case RRA:
-                execute_RRA(cpu);
-                break;
-            case JP:
-                execute_JP(cpu, instr);
-                break;
-            case JR:
-                execute_JR(cpu, instr);
-                break;
-            case CALL:
-                execute_CALL(cpu, instr);
-                break;
-            case RST:
-                execute_RST(cpu, instr);
-                break;
-            case RET:
-                execute_RET(cpu, instr);
-                break;
-            case RETI:
-                execute_RETI(cpu);
-                break;
-            case CB:
-                cpu->isCB = true;
-                return;
-            case ADDSP:
-                execute_ADDSP(cpu);
-                break;
-            default:
-                printf("Invalid unprefixed instruction %d \n", instr.type);
-                exit(0);
-        }
+        b->native();
     }
-    else {
-        switch (instr.type) {
-            case SWAP:
-                execute_SWAP(cpu, instr);
-                break;
-            case RLC:
-                execute_RLC(cpu, instr);
-                break;
-            case RL:
-                execute_RL(cpu, instr);
-                break;
-            case RRC:
-                execute_RRC(cpu, instr);
-                break;
-            case RR:
-                execute_RR(cpu, instr);
-                break;
-            case SLA:
-                execute_SLA(cpu, instr);
-                break;
-            case SRA:
-                execute_SRA(cpu, instr);
-                break;
-            case SRL:
-                execute_SRL(cpu, instr);
-                break;
-            case BIT:
-                execute_BIT(cpu, instr);
-                break;
-            case SET:
-                execute_SET(cpu, instr);
-                break;
-            case RES:
-                execute_RES(cpu, instr);
-                break;
-            default:
-                printf("Invalid prefixed instruction %d \n", instr.type);
-                exit(0);
+    else
+#endif
+        for (u8 i = 0; i < b->numInstrs; i++) {
+            u16 opcode = b->opcodes[i];
+            const decodedInstr *instr;
+
+            if (i != 0 && !block_canContinue(cpu))
+                return;
+
+            if (opcode < FUSED_OPCODE)
+                instr = &decodedInstrs[opcode];
+            else {
+                instr = fusedInstrs[opcode - FUSED_OPCODE].instrs;
+                opcode = fusedInstrs[opcode - FUSED_OPCODE].opcodes[0];
+            }
+
+#ifdef TEST_CHECK
+            checkMooneyeTest(cpu, (opcode > 0xFF) ? 0xCB : opcode);
+#endif
+#ifdef DEBUG
+            opcode_print(logFile, opcode);
+#endif
+#ifdef PROFILE_PAIRS
+            profile_count(opcode);
+#endif
+            cpu->PC += (opcode > 0xFF) ? 2 : 1;
+            execute(cpu, instr);
+#ifdef DEBUG
+            reg_print(logFile, cpu);
+#endif
         }
-        cpu->isCB = false;
+
+    // the trace has to show every instruction
+#ifndef DEBUG
+    if (b->isIdleLoop && cpu->PC == b->addr) {
+        timing_catchUp();
+        idle_skip(cpu, b, startCycle);
     }
-};
+#endif
+}
+
+static u8 IF_read(u16 addr) { return IF_register; }
+
+static void IF_write(u16 addr, u8 data) {
+    IF_register = data | 0xE0;
+    pending_update(&_cpu);
+}
+
+void cpu_requestInterrupt(u8 idx) {
+    bit_set(&IF_register, idx);
+    pending_update(&_cpu);
+}
+
+void cpu_writeIE(u8 data) {
+    IE_register = data;
+    pending_update(&_cpu);
+}
+
+void cpu_mapIO() { bus_mapIO(0xFF0F, &IF_read, &IF_write, 0xE0); }
 
 void cpu_init() {
     bool isChecksumNonZero = bus_read(0x014D, false) != 0;
 
     _cpu.A = 0x01;
-    _cpu.F = 0xB0;
-    flag_reg_write(&_cpu, H, isChecksumNonZero);
-    flag_reg_write(&_cpu, C, isChecksumNonZero);
+    flags_write(&_cpu, 0x80 | (isChecksumNonZero ? 0x30 : 0x00));
     _cpu.B = 0x00;
     _cpu.C = 0x13;
     _cpu.D = 0x00;
@@ -1361,7 +1775,6 @@ void cpu_init() {
     _cpu.PC = 0x100;
     _cpu.SP = 0xFFFE;
 
-    _cpu.isCB = false;
     _cpu.isHaltBug = false;
     _cpu.isHalted = false;
     _cpu.IME = false;
@@ -1369,48 +1782,142 @@ void cpu_init() {
 
     IE_register = 0;
     IF_register = 0xE1;
+    pending_update(&_cpu);
+
+    tables_init();
+
+    for (u16 opcode = 0; opcode < 0x200; opcode++) {
+        // the prefix itself is never dispatched
+        if (opcode != 0xCB)
+            decodedInstrs[opcode] = decode(&_cpu, opcode);
+    }
+
+    // pairs without a fused handler for their handlers are left alone
+    numFusedInstrs = 0;
+    for (u16 i = 0; i < NUM_FUSION_PAIRS; i++) {
+        u16 first = fusionPairs[i][0];
+        u16 second = fusionPairs[i][1];
+        u8 handler;
+
+        if (first == 0xCB || second == 0xCB || second > 0xFF)
+            continue;
+        handler = fused_handler(decodedInstrs[first].handler, decodedInstrs[second].handler);
+        if (handler == NUM_HANDLERS)
+            continue;
+
+        fusedInstr *fused = &fusedInstrs[numFusedInstrs++];
+        fused->opcodes[0] = first;
+        fused->opcodes[1] = second;
+        fused->instrs[0] = decodedInstrs[first];
+        fused->instrs[0].handler = handler;
+        fused->instrs[1] = decodedInstrs[second];
+    }
 }
 
+// runs one instruction, or one block, after the interrupts
 #ifdef DEBUG
-void cpu_run(FILE *logFile) {
+static inline void cpu_step(FILE *logFile) {
 #else
-void cpu_run() {
+static inline void cpu_step() {
 #endif
-    instruction currInstr;
-
-    joypad_readInput();
-    // check if cpu is halted
-    if (_cpu.isHalted) {
-        if ((IE_register & IF_register & 0x1F) != 0) {
-            _cpu.isHalted = false;
+    u16 opcode;
+
+    timing_catchUp();
+    // most of the time there is nothing to check before the next instruction
+    if (_cpu.isPending) {
+        // check if cpu is halted
+        if (_cpu.isHalted) {
+            if ((IE_register & IF_register & 0x1F) != 0) {
+                _cpu.isHalted = false;
+                pending_update(&_cpu);
+            }
+            else {
+                // IE & IF can only change when an event runs, there is nothing to do until then
+                timing_skipToEvent();
+                tick_MCycle();
+                return;
+            }
         }
-        else {
-            tick_MCycle();
-            return;
+
+        // handle interrupts
+        if (_cpu.IME && ((IE_register & IF_register & 0x1F) != 0)) {
+            handle_interrupts(&_cpu);
+#ifdef PROFILE_PAIRS
+            prevOpcode = NO_OPCODE;
+#endif
         }
-    }
 
-    // handle interrupts
-    if (_cpu.IME && ((IE_register & IF_register & 0x1F) != 0)) {
-        handle_interrupts(&_cpu);
+        // set the IME flag to 1 if scheduled
+        if (_cpu.scheduledIME) {
+            _cpu.scheduledIME = false;
+            _cpu.IME = true;
+            pending_update(&_cpu);
+        }
     }
 
-    // set the IME flag to 1 if scheduled
-    if (_cpu.scheduledIME) {
-        _cpu.scheduledIME = false;
-        _cpu.IME = true;
+    // the halt bug repeats the fetch of the next opcode, and during a DMA the opcodes can be
+    // read from the bus of its source, leave both to fetch_instruction
+    block *b = (_cpu.isHaltBug || !blockCacheEnabled || oam.state == ACTIVE) ? NULL : block_lookup(&_cpu);
+    if (b != NULL) {
+#ifdef DEBUG
+        block_run(&_cpu, b, logFile);
+#else
+        block_run(&_cpu, b);
+#endif
+        return;
     }
 
-    // fetch instruction
+    // code that can't be cached is run one instruction at a time
 #ifdef DEBUG
-    currInstr = fetch_instruction(&_cpu, logFile);
+    opcode = fetch_instruction(&_cpu, logFile);
 #else
-    currInstr = fetch_instruction(&_cpu);
+    opcode = fetch_instruction(&_cpu);
+#endif
+#ifdef PROFILE_PAIRS
+    profile_count(opcode);
 #endif
     // execute
-    execute(&_cpu, currInstr);
+    execute(&_cpu, &decodedInstrs[opcode]);
+
+#ifdef DEBUG
+    reg_print(logFile, &_cpu);
+#endif
+}
+
+#ifdef DEBUG
+void cpu_run(FILE *logFile) { cpu_step(logFile); }
+#else
+void cpu_run() { cpu_step(); }
+#endif
+
+// returns at the first instruction boundary at or after the deadline
+#ifdef DEBUG
+void cpu_runUntilCycle(u64 deadline, FILE *logFile) {
+#else
+void cpu_runUntilCycle(u64 deadline) {
+#endif
+    timing_schedule(EVENT_DEADLINE, deadline);
+    while (masterCycles < deadline)
+#ifdef DEBUG
+        cpu_step(logFile);
+#else
+        cpu_step();
+#endif
+    timing_cancel(EVENT_DEADLINE);
+}
+
+// returns after the instruction during which the ppu enters VBLANK
+#ifdef DEBUG
+void cpu_runUntilVBlank(FILE *logFile) {
+#else
+void cpu_runUntilVBlank() {
+#endif
+    u64 startVBlank = vblankCount;
 
+    while (vblankCount == startVBlank)
 #ifdef DEBUG
-    reg_print(logFile, _cpu);
+        cpu_step(logFile);
+#else
+        cpu_step();
 #endif
 }
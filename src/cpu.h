@@ -7,16 +7,46 @@
 #include "timers.h"
 #include "types.h"
 
+// a register pair, readable as one 16 bit register or as its two 8 bit halves
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REG_PAIR(hi, lo)                                                                                                                                                                               \
+    union {                                                                                                                                                                                            \
+        struct {                                                                                                                                                                                       \
+            u8 hi, lo;                                                                                                                                                                                 \
+        };                                                                                                                                                                                             \
+        u16 hi##lo;                                                                                                                                                                                    \
+    }
+#else
+#define REG_PAIR(hi, lo)                                                                                                                                                                               \
+    union {                                                                                                                                                                                            \
+        struct {                                                                                                                                                                                       \
+            u8 lo, hi;                                                                                                                                                                                 \
+        };                                                                                                                                                                                             \
+        u16 hi##lo;                                                                                                                                                                                    \
+    }
+#endif
+
+// everything the instruction handlers touch fits in one cache line
 typedef struct _cpu {
-    // registers
-    u8 F, A, C, B, E, D, L, H;
+    // registers, F is only up to date right after PUSH AF
+    REG_PAIR(A, F);
+    REG_PAIR(B, C);
+    REG_PAIR(D, E);
+    REG_PAIR(H, L);
     u16 SP, PC;
 
+    // lazy flags: Z is set when lazyZ is 0, H is bit 4 of lazyH and C is bit 8 of lazyC
+    u8 lazyZ;
+    u8 lazyN;
+    u8 lazyH;
+    u16 lazyC;
+
     bool isHalted;
     bool isHaltBug;
-    bool isCB;
     bool IME;
     bool scheduledIME;
+    // set while the cpu is halted, IME is scheduled or an enabled interrupt is requested with IME set
+    bool isPending;
 } cpu;
 
 typedef enum FLAG {
@@ -33,11 +63,27 @@ extern u8 IF_register;
 extern bool testPassed;
 #endif
 
+void cpu_mapIO();
+void cpu_requestInterrupt(u8 idx);
+void cpu_writeIE(u8 data);
+void cpu_invalidateCode(u8 page);
+void cpu_endBlock();
+void cpu_useBlockCache(bool enabled);
+void cpu_useRecompiler(bool enabled);
+void cpu_loadIdleLoopList(const char *path);
+u64 cpu_idleCycles();
+#ifdef PROFILE_PAIRS
+void cpu_savePairCounts(const char *path);
+#endif
 void cpu_init();
 #ifdef DEBUG
 void cpu_run(FILE *logFile);
+void cpu_runUntilCycle(u64 deadline, FILE *logFile);
+void cpu_runUntilVBlank(FILE *logFile);
 #else
 void cpu_run();
+void cpu_runUntilCycle(u64 deadline);
+void cpu_runUntilVBlank();
 #endif
 
 #endif
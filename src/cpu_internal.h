@@ -0,0 +1,109 @@
+#ifndef CPU_INTERNAL_H
+#define CPU_INTERNAL_H
+
+// what the interpreter in cpu.c shares with the recompiler in jit_translate.c
+
+#include "cpu.h"
+#include "jit.h"
+
+// every handler the decoded instructions can dispatch to
+#define HANDLER_LIST(X)                                                                                                                                                                                \
+    X(OP_LD_R_R) X(OP_LD_R_N) X(OP_LD_R_MEM) X(OP_LD_MEM_R) X(OP_LD_HL_N) X(OP_LD_A_NN) X(OP_LD_NN_A) X(OP_LD_A_C) X(OP_LD_C_A) X(OP_LDH_A_N) X(OP_LDH_N_A) X(OP_LDD_A_HL) X(OP_LDD_HL_A)              \
+    X(OP_LDI_A_HL) X(OP_LDI_HL_A) X(OP_LD_RR_NN) X(OP_LD_SP_HL) X(OP_LDHL) X(OP_LD_NN_SP)                                                                                                              \
+    X(OP_PUSH) X(OP_PUSH_AF) X(OP_POP) X(OP_POP_AF)                                                                                                                                                    \
+    X(OP_ADD_R) X(OP_ADD_HL) X(OP_ADD_N) X(OP_ADC_R) X(OP_ADC_HL) X(OP_ADC_N) X(OP_SUB_R) X(OP_SUB_HL) X(OP_SUB_N) X(OP_SBC_R) X(OP_SBC_HL) X(OP_SBC_N) X(OP_AND_R) X(OP_AND_HL) X(OP_AND_N)           \
+    X(OP_OR_R) X(OP_OR_HL) X(OP_OR_N) X(OP_XOR_R) X(OP_XOR_HL) X(OP_XOR_N) X(OP_CP_R) X(OP_CP_HL) X(OP_CP_N)                                                                                           \
+    X(OP_ADD16) X(OP_ADDSP) X(OP_INC_R) X(OP_INC_HL) X(OP_DEC_R) X(OP_DEC_HL) X(OP_INC16) X(OP_DEC16)                                                                                                  \
+    X(OP_DAA) X(OP_CPL) X(OP_CCF) X(OP_SCF) X(OP_NOP) X(OP_HALT) X(OP_STOP) X(OP_DI) X(OP_EI) X(OP_SHIFT_A)                                                                                            \
+    X(OP_JP) X(OP_JP_CC) X(OP_JP_HL) X(OP_JR) X(OP_JR_CC) X(OP_CALL) X(OP_CALL_CC) X(OP_RST) X(OP_RET) X(OP_RET_CC) X(OP_RETI)                                                                         \
+    X(OP_SHIFT_R) X(OP_SHIFT_HL)                                                                                                                                                                       \
+    X(OP_BIT_R) X(OP_BIT_HL) X(OP_RES_R) X(OP_RES_HL) X(OP_SET_R) X(OP_SET_HL)
+
+// pairs of handlers that also have a fused handler, OP_<first>_<second>, running both in a single dispatch
+#define FUSED_LIST(X)                                                                                                                                                                                  \
+    X(LDI_A_HL, LD_MEM_R) X(LD_R_MEM, LDI_HL_A) X(LD_MEM_R, INC16) X(LDI_HL_A, DEC_R) X(DEC16, LD_R_R) X(LD_R_R, OR_R) X(LDH_A_N, CP_N)                                                                \
+    X(DEC_R, JR_CC) X(OR_R, JR_CC) X(CP_N, JR_CC) X(AND_N, JR_CC) X(BIT_R, JR_CC)
+
+#define HANDLER_ENUM(name) name,
+#define FUSED_ENUM(first, second) OP_##first##_##second,
+typedef enum HANDLER { HANDLER_LIST(HANDLER_ENUM) FUSED_LIST(FUSED_ENUM) NUM_HANDLERS } HANDLER;
+
+// an instruction with its operands resolved, built once for every opcode
+typedef struct decodedInstr {
+    u8 handler;
+    // bit index or RST vector
+    u8 n;
+    // conditional instructions are taken when (F & flagMask) == flagExpect
+    u8 flagMask;
+    u8 flagExpect;
+    // size in bytes, including the prefix and the immediate operands
+    u8 length;
+    u8 *r;
+    u8 *r2;
+    u16 *rr;
+} decodedInstr;
+
+// CB prefixed instructions are stored after the unprefixed ones
+extern decodedInstr decodedInstrs[0x200];
+
+// blocks refer to a fused pair as FUSED_OPCODE + its index
+#define FUSED_OPCODE 0x200
+
+// the rotates and shifts, in the order of their CB opcodes
+typedef enum SHIFT_OP { SHIFT_RLC, SHIFT_RRC, SHIFT_RL, SHIFT_RR, SHIFT_SLA, SHIFT_SRA, SHIFT_SWAP, SHIFT_SRL, NUM_SHIFT_OPS } SHIFT_OP;
+
+// result of every shift for every input and carry, the new C flag is stored in bit 8
+extern u16 shiftTable[NUM_SHIFT_OPS][2][0x100];
+// result of DAA for every value of A and every (N, H, C), the new C flag is stored in bit 8
+extern u16 DAATable[8][0x100];
+
+// set when the block being run may no longer match the memory
+extern bool stopBlock;
+
+// the extra M cycle of the CB prefix is ticked first
+void execute(cpu *cpu, const decodedInstr *instr);
+#ifdef DEBUG
+void opcode_print(FILE *fp, u16 opcode);
+void reg_print(FILE *fp, cpu *cpu);
+#endif
+#ifdef TEST_CHECK
+void checkMooneyeTest(cpu *cpu, u8 opcode);
+#endif
+
+// blocks of straight-line code are decoded once and run without fetching their opcodes again,
+// they are keyed by the host address of their first opcode so every ROM bank gets its own blocks
+#define BLOCK_CACHE_BITS 12
+#define BLOCK_MAX_INSTRS 32
+
+typedef struct block {
+    // host address of the first opcode, NULL while the entry is empty
+    const u8 *code;
+    // codeGen of the page when the block was built
+    u32 gen;
+    u16 addr;
+    u8 numInstrs;
+    // the block ends with a jump back to its start and can be skipped while it has no effect
+    bool isIdleLoop;
+    u16 opcodes[BLOCK_MAX_INSTRS];
+#ifdef JIT
+    // the recompiled block, NULL until the block ran JIT_THRESHOLD times
+    void (*native)();
+    u16 numRuns;
+#endif
+} block;
+
+extern block blockCache[1 << BLOCK_CACHE_BITS];
+
+#ifdef JIT
+// hot blocks in ROM are recompiled to x86-64 once they ran this many times
+#define JIT_THRESHOLD 16
+
+// returns false when the code can't be written or run, the blocks keep running in the block cache
+bool block_compile(cpu *cpu, block *b);
+#ifdef DEBUG
+// the trace of the recompiled blocks
+extern FILE *jitLogFile;
+#endif
+#endif
+
+#endif
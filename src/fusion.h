@@ -0,0 +1,32 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+// opcode pairs that run as a single fused handler when they follow each other in a block,
+// CB prefixed opcodes are 0x100 | opcode. This default list holds the copy, fill, delay and polling loops
+// common to most games, regenerate it from the pair counts of a PROFILE_PAIRS build with make fusion PAIRS="..."
+#define FUSION_PAIRS(X)                                                                                                                                                                                \
+    X(0x2A, 0x12) /* LD A,(HL+) ; LD (DE),A */                                                                                                                                                         \
+    X(0x1A, 0x22) /* LD A,(DE)  ; LD (HL+),A */                                                                                                                                                        \
+    X(0x12, 0x13) /* LD (DE),A  ; INC DE */                                                                                                                                                            \
+    X(0x22, 0x05) /* LD (HL+),A ; DEC B */                                                                                                                                                             \
+    X(0x22, 0x0D) /* LD (HL+),A ; DEC C */                                                                                                                                                             \
+    X(0x05, 0x20) /* DEC B      ; JR NZ */                                                                                                                                                             \
+    X(0x0D, 0x20) /* DEC C      ; JR NZ */                                                                                                                                                             \
+    X(0x15, 0x20) /* DEC D      ; JR NZ */                                                                                                                                                             \
+    X(0x3D, 0x20) /* DEC A      ; JR NZ */                                                                                                                                                             \
+    X(0x0B, 0x78) /* DEC BC     ; LD A,B */                                                                                                                                                            \
+    X(0x78, 0xB1) /* LD A,B     ; OR C */                                                                                                                                                              \
+    X(0xB1, 0x20) /* OR C       ; JR NZ */                                                                                                                                                             \
+    X(0xF0, 0xFE) /* LDH A,(n)  ; CP n */                                                                                                                                                              \
+    X(0xFE, 0x20) /* CP n       ; JR NZ */                                                                                                                                                             \
+    X(0xFE, 0x28) /* CP n       ; JR Z */                                                                                                                                                              \
+    X(0xFE, 0x38) /* CP n       ; JR C */                                                                                                                                                              \
+    X(0xFE, 0x30) /* CP n       ; JR NC */                                                                                                                                                             \
+    X(0xE6, 0x28) /* AND n      ; JR Z */                                                                                                                                                              \
+    X(0xE6, 0x20) /* AND n      ; JR NZ */                                                                                                                                                             \
+    X(0x17F, 0x28) /* BIT 7,A   ; JR Z */                                                                                                                                                              \
+    X(0x17F, 0x20) /* BIT 7,A   ; JR NZ */                                                                                                                                                             \
+    X(0x147, 0x28) /* BIT 0,A   ; JR Z */                                                                                                                                                              \
+    X(0x147, 0x20) /* BIT 0,A   ; JR NZ */
+
+#endif
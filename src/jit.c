@@ -0,0 +1,272 @@
+#include "jit.h"
+
+#ifdef JIT
+#include <string.h>
+#include <sys/mman.h>
+#ifdef PERF_MAP
+#include <unistd.h>
+#endif
+
+#define JIT_BUFFER_SIZE (8 << 20)
+
+static u8 *buffer;
+static u8 *cursor;
+#ifdef PERF_MAP
+static FILE *perfMap;
+static bool isPerfMapOpened;
+#endif
+
+bool jit_init() {
+    if (buffer != NULL)
+        return true;
+
+    void *mem = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        printf("Can't map memory for the recompiled code, falling back to the block cache \n");
+        return false;
+    }
+    buffer = mem;
+    cursor = buffer;
+    return true;
+}
+
+bool jit_setWritable(bool isWritable) {
+    if (mprotect(buffer, JIT_BUFFER_SIZE, isWritable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0) {
+        printf("Can't change the protection of the recompiled code, falling back to the block cache \n");
+        return false;
+    }
+    return true;
+}
+
+void jit_reset() {
+    cursor = buffer;
+#ifdef PERF_MAP
+    // the addresses get reused, the map is started over
+    if (perfMap != NULL)
+        fclose(perfMap);
+    perfMap = NULL;
+    isPerfMapOpened = false;
+#endif
+}
+
+bool jit_hasRoom(u32 size) { return cursor + size <= buffer + JIT_BUFFER_SIZE; }
+
+u8 *jit_cursor() { return cursor; }
+
+#ifdef PERF_MAP
+void jit_name(const u8 *start, const char *name) {
+    if (!isPerfMapOpened) {
+        char path[32];
+
+        isPerfMapOpened = true;
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+        perfMap = fopen(path, "w");
+    }
+    if (perfMap != NULL) {
+        fprintf(perfMap, "%lx %lx %s\n", (unsigned long)(uintptr_t)start, (unsigned long)(cursor - start), name);
+        fflush(perfMap);
+    }
+}
+#endif
+
+static void emit8(u8 val) { *cursor++ = val; }
+
+static void emit16(u16 val) {
+    memcpy(cursor, &val, sizeof(val));
+    cursor += sizeof(val);
+}
+
+static void emit32(u32 val) {
+    memcpy(cursor, &val, sizeof(val));
+    cursor += sizeof(val);
+}
+
+static void emit64(u64 val) {
+    memcpy(cursor, &val, sizeof(val));
+    cursor += sizeof(val);
+}
+
+static bool isInt8(int32 val) { return val >= -128 && val <= 127; }
+
+// REX is only needed by the 64 bit operations and by R8-R15
+static void emit_rex(bool isWide, u8 reg, u8 rm) {
+    u8 rex = 0x40 | (isWide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        emit8(rex);
+}
+
+static void emit_regReg(u8 reg, u8 rm) { emit8(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+// ModRM of [base + disp], RSP and R12 need a SIB byte, RBP and R13 always need a displacement
+static void emit_mem(u8 reg, x64reg base, int32 disp) {
+    u8 mod = (disp == 0 && (base & 7) != RBP) ? 0x00 : isInt8(disp) ? 0x40 : 0x80;
+
+    emit8(mod | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit8(0x24);
+    if (mod == 0x40)
+        emit8((u8)disp);
+    else if (mod == 0x80)
+        emit32(disp);
+}
+
+// op is a register or an opcode extension, opcodes above 0xFF are the two byte 0x0F ones
+static void emit_memOp(bool isWide, u16 opcode, u8 op, x64reg base, int32 disp) {
+    emit_rex(isWide, op, base);
+    if (opcode > 0xFF)
+        emit8(opcode >> 8);
+    emit8(opcode & 0xFF);
+    emit_mem(op, base, disp);
+}
+
+void x64_loadU8(x64reg dst, x64reg base, int32 disp) { emit_memOp(false, 0x0FB6, dst, base, disp); }
+
+void x64_loadU16(x64reg dst, x64reg base, int32 disp) { emit_memOp(false, 0x0FB7, dst, base, disp); }
+
+void x64_load64(x64reg dst, x64reg base, int32 disp) { emit_memOp(true, 0x8B, dst, base, disp); }
+
+void x64_store8(x64reg base, int32 disp, x64reg src) { emit_memOp(false, 0x88, src, base, disp); }
+
+void x64_store16(x64reg base, int32 disp, x64reg src) {
+    emit8(0x66);
+    emit_memOp(false, 0x89, src, base, disp);
+}
+
+void x64_storeImm8(x64reg base, int32 disp, u8 imm) {
+    emit_memOp(false, 0xC6, 0, base, disp);
+    emit8(imm);
+}
+
+void x64_storeImm16(x64reg base, int32 disp, u16 imm) {
+    emit8(0x66);
+    emit_memOp(false, 0xC7, 0, base, disp);
+    emit16(imm);
+}
+
+void x64_mov(x64reg dst, x64reg src) {
+    emit_rex(true, src, dst);
+    emit8(0x89);
+    emit_regReg(src, dst);
+}
+
+void x64_movImm32(x64reg dst, u32 imm) {
+    emit_rex(false, 0, dst);
+    emit8(0xB8 + (dst & 7));
+    emit32(imm);
+}
+
+void x64_movImm64(x64reg dst, u64 imm) {
+    emit_rex(true, 0, dst);
+    emit8(0xB8 + (dst & 7));
+    emit64(imm);
+}
+
+void x64_alu(x64alu op, x64reg dst, x64reg src) {
+    emit_rex(false, src, dst);
+    emit8(op * 8 + 1);
+    emit_regReg(src, dst);
+}
+
+void x64_alu64(x64alu op, x64reg dst, x64reg src) {
+    emit_rex(true, src, dst);
+    emit8(op * 8 + 1);
+    emit_regReg(src, dst);
+}
+
+static void emit_aluImm(bool isWide, x64alu op, x64reg dst, int32 imm) {
+    emit_rex(isWide, 0, dst);
+    emit8(isInt8(imm) ? 0x83 : 0x81);
+    emit_regReg(op, dst);
+    if (isInt8(imm))
+        emit8((u8)imm);
+    else
+        emit32(imm);
+}
+
+void x64_aluImm(x64alu op, x64reg dst, int32 imm) { emit_aluImm(false, op, dst, imm); }
+
+void x64_aluImm64(x64alu op, x64reg dst, int32 imm) { emit_aluImm(true, op, dst, imm); }
+
+void x64_aluLoad64(x64alu op, x64reg dst, x64reg base, int32 disp) { emit_memOp(true, op * 8 + 3, dst, base, disp); }
+
+void x64_aluMem8(x64alu op, x64reg base, int32 disp, u8 imm) {
+    emit_memOp(false, 0x80, op, base, disp);
+    emit8(imm);
+}
+
+void x64_aluMem16(x64alu op, x64reg base, int32 disp, u16 imm) {
+    emit8(0x66);
+    emit_memOp(false, 0x81, op, base, disp);
+    emit16(imm);
+}
+
+void x64_aluMem64(x64alu op, x64reg base, int32 disp, int32 imm) {
+    emit_memOp(true, isInt8(imm) ? 0x83 : 0x81, op, base, disp);
+    if (isInt8(imm))
+        emit8((u8)imm);
+    else
+        emit32(imm);
+}
+
+void x64_testMem16(x64reg base, int32 disp, u16 imm) {
+    emit8(0x66);
+    emit_memOp(false, 0xF7, 0, base, disp);
+    emit16(imm);
+}
+
+void x64_incMem16(x64reg base, int32 disp) {
+    emit8(0x66);
+    emit_memOp(false, 0xFF, 0, base, disp);
+}
+
+void x64_decMem16(x64reg base, int32 disp) {
+    emit8(0x66);
+    emit_memOp(false, 0xFF, 1, base, disp);
+}
+
+void x64_notMem8(x64reg base, int32 disp) { emit_memOp(false, 0xF6, 2, base, disp); }
+
+void x64_shiftImm(x64shift op, x64reg dst, u8 count) {
+    emit_rex(false, 0, dst);
+    emit8(0xC1);
+    emit_regReg(op, dst);
+    emit8(count);
+}
+
+void x64_push(x64reg reg) {
+    emit_rex(false, 0, reg);
+    emit8(0x50 + (reg & 7));
+}
+
+void x64_pop(x64reg reg) {
+    emit_rex(false, 0, reg);
+    emit8(0x58 + (reg & 7));
+}
+
+// the code buffer can be anywhere, the call goes through RAX
+void x64_call(const void *fn) {
+    x64_movImm64(RAX, (u64)(uintptr_t)fn);
+    emit8(0xFF);
+    emit_regReg(2, RAX);
+}
+
+void x64_ret() { emit8(0xC3); }
+
+u8 *x64_jcc(x64cond cond) {
+    emit8(0x0F);
+    emit8(0x80 + cond);
+    emit32(0);
+    return cursor - 4;
+}
+
+u8 *x64_jmp() {
+    emit8(0xE9);
+    emit32(0);
+    return cursor - 4;
+}
+
+void x64_patch(u8 *disp, const u8 *target) {
+    int32 rel = (int32)(target - (disp + 4));
+    memcpy(disp, &rel, sizeof(rel));
+}
+#endif
@@ -0,0 +1,66 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "types.h"
+
+// hot blocks are recompiled to x86-64 on hosts that can run it, the pair counts need the interpreter
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT) && !defined(PROFILE_PAIRS)
+#define JIT
+
+// the registers in the order of their encoding
+typedef enum x64reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 } x64reg;
+
+// the ALU operations in the order of their opcode extension
+typedef enum x64alu { X64_ADD, X64_OR, X64_ADC, X64_SBB, X64_AND, X64_SUB, X64_XOR, X64_CMP } x64alu;
+
+typedef enum x64shift { X64_SHL = 4, X64_SHR = 5 } x64shift;
+
+typedef enum x64cond { X64_AE = 0x3, X64_E = 0x4, X64_NE = 0x5 } x64cond;
+
+// the generated code is written to one buffer, it is emptied when it is full
+bool jit_init();
+// the buffer is executable except while code is written to it
+bool jit_setWritable(bool isWritable);
+void jit_reset();
+bool jit_hasRoom(u32 size);
+u8 *jit_cursor();
+#ifdef PERF_MAP
+// lists the code emitted since start in /tmp/perf-<pid>.map, so perf can name it
+void jit_name(const u8 *start, const char *name);
+#endif
+
+// every memory operand is [base + disp], every 8 bit register is AL, CL, DL or BL
+void x64_loadU8(x64reg dst, x64reg base, int32 disp);
+void x64_loadU16(x64reg dst, x64reg base, int32 disp);
+void x64_load64(x64reg dst, x64reg base, int32 disp);
+void x64_store8(x64reg base, int32 disp, x64reg src);
+void x64_store16(x64reg base, int32 disp, x64reg src);
+void x64_storeImm8(x64reg base, int32 disp, u8 imm);
+void x64_storeImm16(x64reg base, int32 disp, u16 imm);
+void x64_mov(x64reg dst, x64reg src);
+void x64_movImm32(x64reg dst, u32 imm);
+void x64_movImm64(x64reg dst, u64 imm);
+void x64_alu(x64alu op, x64reg dst, x64reg src);
+void x64_alu64(x64alu op, x64reg dst, x64reg src);
+void x64_aluImm(x64alu op, x64reg dst, int32 imm);
+void x64_aluImm64(x64alu op, x64reg dst, int32 imm);
+void x64_aluLoad64(x64alu op, x64reg dst, x64reg base, int32 disp);
+void x64_aluMem8(x64alu op, x64reg base, int32 disp, u8 imm);
+void x64_aluMem16(x64alu op, x64reg base, int32 disp, u16 imm);
+void x64_aluMem64(x64alu op, x64reg base, int32 disp, int32 imm);
+void x64_testMem16(x64reg base, int32 disp, u16 imm);
+void x64_incMem16(x64reg base, int32 disp);
+void x64_decMem16(x64reg base, int32 disp);
+void x64_notMem8(x64reg base, int32 disp);
+void x64_shiftImm(x64shift op, x64reg dst, u8 count);
+void x64_push(x64reg reg);
+void x64_pop(x64reg reg);
+void x64_call(const void *fn);
+void x64_ret();
+// the jumps return the displacement to patch once the target is known
+u8 *x64_jcc(x64cond cond);
+u8 *x64_jmp();
+void x64_patch(u8 *disp, const u8 *target);
+#endif
+
+#endif
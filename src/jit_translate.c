@@ -0,0 +1,637 @@
+#include "cpu_internal.h"
+#include "timing.h"
+
+#ifdef JIT
+#include <stddef.h>
+
+// the recompiled code works on the registers in the cpu struct and adds the cycles of its
+// instructions to masterCycles before every bus access and where the block exits
+
+// a block of BLOCK_MAX_INSTRS instructions and all of its exits fit in it
+#define JIT_MAX_CODE_SIZE 0x4000
+#define JIT_MAX_EXITS (3 * BLOCK_MAX_INSTRS)
+
+// the host registers that hold the cpu, &masterCycles and &nextEventCycle in the recompiled code
+#define JIT_CPU RBX
+#define JIT_CYCLES R12
+#define JIT_NEXT_EVENT R13
+
+#define JIT_FIELD(field) ((int32)offsetof(struct _cpu, field))
+
+// the block exits before the instruction at PC, the cycles are added there
+typedef struct jitExit {
+    u8 *jump;
+    u32 cycles;
+    u16 PC;
+} jitExit;
+
+static struct {
+    // the registers of the decoded instructions point into it
+    cpu *cpu;
+    // cycles of the translated instructions that are not added to masterCycles yet
+    u32 cycles;
+    // a bus access or a handler ran since stopBlock and isPending were checked
+    bool isUnchecked;
+    u8 numExits;
+    jitExit exits[JIT_MAX_EXITS];
+} jit;
+
+#ifdef DEBUG
+FILE *jitLogFile;
+
+static void jit_trace(cpu *cpu, u16 opcode) {
+    opcode_print(jitLogFile, opcode);
+    reg_print(jitLogFile, cpu);
+}
+#endif
+
+static u8 jit_busRead(u16 addr) { return bus_read(addr, true); }
+
+static void jit_busWrite(u16 addr, u8 data) { bus_write(addr, data, true); }
+
+static void jit_catchUp() { timing_catchUp(); }
+
+// the instructions without a translation run through their handler, PC is already past the opcode
+static void jit_execute(cpu *cpu, u16 opcode) {
+#ifdef TEST_CHECK
+    checkMooneyeTest(cpu, (opcode > 0xFF) ? 0xCB : opcode);
+#endif
+    execute(cpu, &decodedInstrs[opcode]);
+}
+
+static int32 jit_offset(const void *reg) { return (int32)((const u8 *)reg - (const u8 *)jit.cpu); }
+
+static void jit_addCycles() {
+    if (jit.cycles != 0)
+        x64_aluMem64(X64_ADD, JIT_CYCLES, 0, jit.cycles);
+    jit.cycles = 0;
+}
+
+static void jit_exitIf(x64cond cond, u16 PC) {
+    jitExit *exit = &jit.exits[jit.numExits++];
+
+    exit->jump = x64_jcc(cond);
+    exit->cycles = jit.cycles;
+    exit->PC = PC;
+}
+
+// block_canContinue before the instruction at PC, an event that comes due in between ends the block
+static void jit_checkContinue(u16 PC) {
+    x64_load64(RAX, JIT_CYCLES, 0);
+    if (jit.cycles != 0)
+        x64_aluImm64(X64_ADD, RAX, jit.cycles);
+    x64_aluLoad64(X64_CMP, RAX, JIT_NEXT_EVENT, 0);
+    jit_exitIf(X64_AE, PC);
+
+    // without an event only the bus accesses and the handlers can end the block
+    if (jit.isUnchecked) {
+        x64_movImm64(RAX, (u64)(uintptr_t)&stopBlock);
+        x64_aluMem8(X64_CMP, RAX, 0, 0);
+        jit_exitIf(X64_NE, PC);
+        x64_aluMem8(X64_CMP, JIT_CPU, JIT_FIELD(isPending), 0);
+        jit_exitIf(X64_NE, PC);
+        jit.isUnchecked = false;
+    }
+}
+
+// the address is in EDI and the byte read is returned in EAX, the access ticks its own M cycle
+static void jit_emitRead() {
+    jit_addCycles();
+    x64_call(&jit_busRead);
+    // only AL is returned
+    x64_aluImm(X64_AND, RAX, 0xFF);
+    jit.isUnchecked = true;
+}
+
+// the address is in EDI and the data in ESI
+static void jit_emitWrite() {
+    jit_addCycles();
+    x64_call(&jit_busWrite);
+    jit.isUnchecked = true;
+}
+
+static void jit_emitHandler(u16 opcode, u16 addr) {
+    jit_addCycles();
+    x64_storeImm16(JIT_CPU, JIT_FIELD(PC), addr + ((opcode > 0xFF) ? 2 : 1));
+    x64_mov(RDI, JIT_CPU);
+    x64_movImm32(RSI, opcode);
+    x64_call(&jit_execute);
+    jit.isUnchecked = true;
+}
+
+static void jit_emitLoadCarry(x64reg dst) {
+    x64_loadU16(dst, JIT_CPU, JIT_FIELD(lazyC));
+    x64_shiftImm(X64_SHR, dst, 8);
+    x64_aluImm(X64_AND, dst, 1);
+}
+
+// EAX = table[ECX]
+static void jit_emitLookup(const u16 *table) {
+    x64_alu64(X64_ADD, RCX, RCX);
+    x64_movImm64(RDX, (u64)(uintptr_t)table);
+    x64_alu64(X64_ADD, RDX, RCX);
+    x64_loadU16(RAX, RDX, 0);
+}
+
+// the operand is in ECX, op is the OP_<OP>_R handler of the operation
+static void jit_emitALU(u8 op) {
+    x64_loadU8(RAX, JIT_CPU, JIT_FIELD(A));
+
+    if (op == OP_AND_R || op == OP_OR_R || op == OP_XOR_R) {
+        x64_alu((op == OP_AND_R) ? X64_AND : (op == OP_OR_R) ? X64_OR : X64_XOR, RAX, RCX);
+        x64_store8(JIT_CPU, JIT_FIELD(A), RAX);
+        x64_store8(JIT_CPU, JIT_FIELD(lazyZ), RAX);
+        x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), 0);
+        x64_storeImm8(JIT_CPU, JIT_FIELD(lazyH), (op == OP_AND_R) ? 0x10 : 0);
+        x64_storeImm16(JIT_CPU, JIT_FIELD(lazyC), 0);
+        return;
+    }
+
+    // EDX holds the unwrapped result
+    x64alu arith = (op == OP_ADD_R || op == OP_ADC_R) ? X64_ADD : X64_SUB;
+    x64_mov(RDX, RAX);
+    x64_alu(arith, RDX, RCX);
+    if (op == OP_ADC_R || op == OP_SBC_R) {
+        jit_emitLoadCarry(RSI);
+        x64_alu(arith, RDX, RSI);
+    }
+    x64_store8(JIT_CPU, JIT_FIELD(lazyZ), RDX);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), arith == X64_SUB);
+    x64_alu(X64_XOR, RAX, RCX);
+    x64_alu(X64_XOR, RAX, RDX);
+    x64_store8(JIT_CPU, JIT_FIELD(lazyH), RAX);
+    x64_store16(JIT_CPU, JIT_FIELD(lazyC), RDX);
+    if (op != OP_CP_R)
+        x64_store8(JIT_CPU, JIT_FIELD(A), RDX);
+}
+
+// the value is in EAX, the result is left in EDX
+static void jit_emitIncDec(bool isInc) {
+    x64_mov(RDX, RAX);
+    x64_aluImm(isInc ? X64_ADD : X64_SUB, RDX, 1);
+    x64_aluImm(X64_AND, RDX, 0xFF);
+    x64_store8(JIT_CPU, JIT_FIELD(lazyZ), RDX);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), !isInc);
+    x64_alu(X64_XOR, RAX, RDX);
+    x64_aluImm(X64_XOR, RAX, 1);
+    x64_store8(JIT_CPU, JIT_FIELD(lazyH), RAX);
+}
+
+// the value is in EAX, the table entry is left in EAX and the flags are set as execute_shift sets them
+static void jit_emitShift(SHIFT_OP op, bool isA) {
+    jit_emitLoadCarry(RCX);
+    x64_shiftImm(X64_SHL, RCX, 8);
+    x64_alu(X64_ADD, RCX, RAX);
+    jit_emitLookup(shiftTable[op][0]);
+    if (isA)
+        x64_storeImm8(JIT_CPU, JIT_FIELD(lazyZ), 1);
+    else
+        x64_store8(JIT_CPU, JIT_FIELD(lazyZ), RAX);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), 0);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyH), 0);
+    x64_store16(JIT_CPU, JIT_FIELD(lazyC), RAX);
+}
+
+// the value is in EAX
+static void jit_emitBit(u8 idx) {
+    x64_aluImm(X64_AND, RAX, 1 << idx);
+    x64_store8(JIT_CPU, JIT_FIELD(lazyZ), RAX);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), 0);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyH), 0x10);
+}
+
+static void jit_emitDAA() {
+    x64_loadU8(RCX, JIT_CPU, JIT_FIELD(lazyN));
+    x64_shiftImm(X64_SHL, RCX, 2);
+    x64_loadU8(RDX, JIT_CPU, JIT_FIELD(lazyH));
+    x64_shiftImm(X64_SHR, RDX, 3);
+    x64_aluImm(X64_AND, RDX, 2);
+    x64_alu(X64_OR, RCX, RDX);
+    jit_emitLoadCarry(RDX);
+    x64_alu(X64_OR, RCX, RDX);
+    x64_shiftImm(X64_SHL, RCX, 8);
+    x64_loadU8(RAX, JIT_CPU, JIT_FIELD(A));
+    x64_alu(X64_ADD, RCX, RAX);
+    jit_emitLookup(DAATable[0]);
+    x64_store8(JIT_CPU, JIT_FIELD(lazyZ), RAX);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyH), 0);
+    x64_store16(JIT_CPU, JIT_FIELD(lazyC), RAX);
+    x64_store8(JIT_CPU, JIT_FIELD(A), RAX);
+}
+
+static void jit_emitADD16(const u16 *rr) {
+    x64_loadU16(RAX, JIT_CPU, JIT_FIELD(HL));
+    x64_loadU16(RCX, JIT_CPU, jit_offset(rr));
+    x64_mov(RDX, RAX);
+    x64_alu(X64_ADD, RDX, RCX);
+    x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), 0);
+    x64_alu(X64_XOR, RAX, RCX);
+    x64_alu(X64_XOR, RAX, RDX);
+    x64_shiftImm(X64_SHR, RAX, 8);
+    x64_store8(JIT_CPU, JIT_FIELD(lazyH), RAX);
+    x64_store16(JIT_CPU, JIT_FIELD(HL), RDX);
+    x64_shiftImm(X64_SHR, RDX, 8);
+    x64_store16(JIT_CPU, JIT_FIELD(lazyC), RDX);
+}
+
+// returns the condition of the x86 flags under which the branch is taken
+static x64cond jit_emitCond(const decodedInstr *instr) {
+    if (instr->flagMask == (1 << Z)) {
+        x64_aluMem8(X64_CMP, JIT_CPU, JIT_FIELD(lazyZ), 0);
+        return (instr->flagExpect != 0) ? X64_E : X64_NE;
+    }
+    x64_testMem16(JIT_CPU, JIT_FIELD(lazyC), 0x100);
+    return (instr->flagExpect != 0) ? X64_NE : X64_E;
+}
+
+// the cycles of the taken branch are added on its own path, both paths leave PC set
+static void jit_emitBranch(const decodedInstr *instr, u16 target, u16 next) {
+    u8 *taken = x64_jcc(jit_emitCond(instr));
+
+    x64_storeImm16(JIT_CPU, JIT_FIELD(PC), next);
+    u8 *join = x64_jmp();
+    x64_patch(taken, jit_cursor());
+    x64_storeImm16(JIT_CPU, JIT_FIELD(PC), target);
+    x64_aluMem64(X64_ADD, JIT_CYCLES, 0, 4);
+    x64_patch(join, jit_cursor());
+}
+
+// a read or a write of (HL) that leaves HL as it is
+static void jit_emitReadHL() {
+    x64_loadU16(RDI, JIT_CPU, JIT_FIELD(HL));
+    jit_emitRead();
+}
+
+// the data is in EAX
+static void jit_emitWriteHL() {
+    x64_mov(RSI, RAX);
+    x64_aluImm(X64_AND, RSI, 0xFF);
+    x64_loadU16(RDI, JIT_CPU, JIT_FIELD(HL));
+    jit_emitWrite();
+}
+
+// the cycles of every M cycle that doesn't access the bus are counted in jit.cycles,
+// returns true when PC was already set, by the instruction itself or by its handler
+static bool jit_translate(const decodedInstr *instr, u16 opcode, const u8 *bytes, u16 addr) {
+    u16 nn = bytes[1] | (bytes[2] << 8);
+    u16 next = addr + instr->length;
+
+    switch (instr->handler) {
+        case OP_LD_R_R:
+#ifdef TEST_CHECK
+            // the test breakpoint
+            if (opcode == 0x40)
+                break;
+#endif
+            x64_loadU8(RAX, JIT_CPU, jit_offset(instr->r2));
+            x64_store8(JIT_CPU, jit_offset(instr->r), RAX);
+            jit.cycles += 4;
+            return false;
+        case OP_LD_R_N:
+            x64_storeImm8(JIT_CPU, jit_offset(instr->r), bytes[1]);
+            jit.cycles += 8;
+            return false;
+        case OP_LD_R_MEM:
+            x64_loadU16(RDI, JIT_CPU, jit_offset(instr->rr));
+            jit_emitRead();
+            x64_store8(JIT_CPU, jit_offset(instr->r), RAX);
+            jit.cycles += 4;
+            return false;
+        case OP_LD_MEM_R:
+            x64_loadU16(RDI, JIT_CPU, jit_offset(instr->rr));
+            x64_loadU8(RSI, JIT_CPU, jit_offset(instr->r));
+            jit_emitWrite();
+            jit.cycles += 4;
+            return false;
+        case OP_LD_HL_N:
+            jit.cycles += 4;
+            x64_movImm32(RAX, bytes[1]);
+            jit_emitWriteHL();
+            jit.cycles += 4;
+            return false;
+        case OP_LD_A_NN:
+        case OP_LDH_A_N:
+            jit.cycles += (instr->handler == OP_LD_A_NN) ? 8 : 4;
+            x64_movImm32(RDI, (instr->handler == OP_LD_A_NN) ? nn : 0xFF00 + bytes[1]);
+            jit_emitRead();
+            x64_store8(JIT_CPU, JIT_FIELD(A), RAX);
+            jit.cycles += 4;
+            return false;
+        case OP_LD_NN_A:
+        case OP_LDH_N_A:
+            jit.cycles += (instr->handler == OP_LD_NN_A) ? 8 : 4;
+            x64_movImm32(RDI, (instr->handler == OP_LD_NN_A) ? nn : 0xFF00 + bytes[1]);
+            x64_loadU8(RSI, JIT_CPU, JIT_FIELD(A));
+            jit_emitWrite();
+            jit.cycles += 4;
+            return false;
+        case OP_LD_A_C:
+            x64_loadU8(RDI, JIT_CPU, JIT_FIELD(C));
+            x64_aluImm(X64_OR, RDI, 0xFF00);
+            jit_emitRead();
+            x64_store8(JIT_CPU, JIT_FIELD(A), RAX);
+            jit.cycles += 4;
+            return false;
+        case OP_LD_C_A:
+            x64_loadU8(RDI, JIT_CPU, JIT_FIELD(C));
+            x64_aluImm(X64_OR, RDI, 0xFF00);
+            x64_loadU8(RSI, JIT_CPU, JIT_FIELD(A));
+            jit_emitWrite();
+            jit.cycles += 4;
+            return false;
+        case OP_LDD_A_HL:
+        case OP_LDI_A_HL:
+            x64_loadU16(RDI, JIT_CPU, JIT_FIELD(HL));
+            if (instr->handler == OP_LDI_A_HL)
+                x64_incMem16(JIT_CPU, JIT_FIELD(HL));
+            else
+                x64_decMem16(JIT_CPU, JIT_FIELD(HL));
+            jit_emitRead();
+            x64_store8(JIT_CPU, JIT_FIELD(A), RAX);
+            jit.cycles += 4;
+            return false;
+        case OP_LDD_HL_A:
+        case OP_LDI_HL_A:
+            x64_loadU16(RDI, JIT_CPU, JIT_FIELD(HL));
+            x64_loadU8(RSI, JIT_CPU, JIT_FIELD(A));
+            if (instr->handler == OP_LDI_HL_A)
+                x64_incMem16(JIT_CPU, JIT_FIELD(HL));
+            else
+                x64_decMem16(JIT_CPU, JIT_FIELD(HL));
+            jit_emitWrite();
+            jit.cycles += 4;
+            return false;
+        case OP_LD_RR_NN:
+            x64_storeImm16(JIT_CPU, jit_offset(instr->rr), nn);
+            jit.cycles += 12;
+            return false;
+        case OP_LD_SP_HL:
+            x64_loadU16(RAX, JIT_CPU, JIT_FIELD(HL));
+            x64_store16(JIT_CPU, JIT_FIELD(SP), RAX);
+            jit.cycles += 8;
+            return false;
+        case OP_ADD_R:
+        case OP_ADC_R:
+        case OP_SUB_R:
+        case OP_SBC_R:
+        case OP_AND_R:
+        case OP_OR_R:
+        case OP_XOR_R:
+        case OP_CP_R:
+            x64_loadU8(RCX, JIT_CPU, jit_offset(instr->r));
+            jit_emitALU(instr->handler);
+            jit.cycles += 4;
+            return false;
+        case OP_ADD_HL:
+        case OP_ADC_HL:
+        case OP_SUB_HL:
+        case OP_SBC_HL:
+        case OP_AND_HL:
+        case OP_OR_HL:
+        case OP_XOR_HL:
+        case OP_CP_HL:
+            jit_emitReadHL();
+            x64_mov(RCX, RAX);
+            jit_emitALU(instr->handler - 1);
+            jit.cycles += 4;
+            return false;
+        case OP_ADD_N:
+        case OP_ADC_N:
+        case OP_SUB_N:
+        case OP_SBC_N:
+        case OP_AND_N:
+        case OP_OR_N:
+        case OP_XOR_N:
+        case OP_CP_N:
+            x64_movImm32(RCX, bytes[1]);
+            jit_emitALU(instr->handler - 2);
+            jit.cycles += 8;
+            return false;
+        case OP_ADD16:
+            jit_emitADD16(instr->rr);
+            jit.cycles += 8;
+            return false;
+        case OP_INC_R:
+        case OP_DEC_R:
+            x64_loadU8(RAX, JIT_CPU, jit_offset(instr->r));
+            jit_emitIncDec(instr->handler == OP_INC_R);
+            x64_store8(JIT_CPU, jit_offset(instr->r), RDX);
+            jit.cycles += 4;
+            return false;
+        case OP_INC_HL:
+        case OP_DEC_HL:
+            jit_emitReadHL();
+            jit_emitIncDec(instr->handler == OP_INC_HL);
+            x64_mov(RAX, RDX);
+            jit_emitWriteHL();
+            jit.cycles += 4;
+            return false;
+        case OP_INC16:
+            x64_incMem16(JIT_CPU, jit_offset(instr->rr));
+            jit.cycles += 8;
+            return false;
+        case OP_DEC16:
+            x64_decMem16(JIT_CPU, jit_offset(instr->rr));
+            jit.cycles += 8;
+            return false;
+        case OP_DAA:
+            jit_emitDAA();
+            jit.cycles += 4;
+            return false;
+        case OP_CPL:
+            x64_notMem8(JIT_CPU, JIT_FIELD(A));
+            x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), 1);
+            x64_storeImm8(JIT_CPU, JIT_FIELD(lazyH), 0x10);
+            jit.cycles += 4;
+            return false;
+        case OP_CCF:
+        case OP_SCF:
+            if (instr->handler == OP_CCF)
+                x64_aluMem16(X64_XOR, JIT_CPU, JIT_FIELD(lazyC), 0x100);
+            else
+                x64_storeImm16(JIT_CPU, JIT_FIELD(lazyC), 0x100);
+            x64_storeImm8(JIT_CPU, JIT_FIELD(lazyN), 0);
+            x64_storeImm8(JIT_CPU, JIT_FIELD(lazyH), 0);
+            jit.cycles += 4;
+            return false;
+        case OP_NOP:
+            jit.cycles += 4;
+            return false;
+        case OP_SHIFT_A:
+            x64_loadU8(RAX, JIT_CPU, JIT_FIELD(A));
+            jit_emitShift(instr->n, true);
+            x64_store8(JIT_CPU, JIT_FIELD(A), RAX);
+            jit.cycles += 4;
+            return false;
+        case OP_SHIFT_R:
+            x64_loadU8(RAX, JIT_CPU, jit_offset(instr->r));
+            jit_emitShift(instr->n, false);
+            x64_store8(JIT_CPU, jit_offset(instr->r), RAX);
+            jit.cycles += 8;
+            return false;
+        case OP_SHIFT_HL:
+            jit.cycles += 4;
+            jit_emitReadHL();
+            jit_emitShift(instr->n, false);
+            jit_emitWriteHL();
+            jit.cycles += 4;
+            return false;
+        case OP_BIT_R:
+            x64_loadU8(RAX, JIT_CPU, jit_offset(instr->r));
+            jit_emitBit(instr->n);
+            jit.cycles += 8;
+            return false;
+        case OP_BIT_HL:
+            jit.cycles += 4;
+            jit_emitReadHL();
+            jit_emitBit(instr->n);
+            jit.cycles += 4;
+            return false;
+        case OP_RES_R:
+            x64_aluMem8(X64_AND, JIT_CPU, jit_offset(instr->r), ~(1 << instr->n));
+            jit.cycles += 8;
+            return false;
+        case OP_SET_R:
+            x64_aluMem8(X64_OR, JIT_CPU, jit_offset(instr->r), 1 << instr->n);
+            jit.cycles += 8;
+            return false;
+        case OP_RES_HL:
+        case OP_SET_HL:
+            jit.cycles += 4;
+            jit_emitReadHL();
+            if (instr->handler == OP_RES_HL)
+                x64_aluImm(X64_AND, RAX, (u8) ~(1 << instr->n));
+            else
+                x64_aluImm(X64_OR, RAX, 1 << instr->n);
+            jit_emitWriteHL();
+            jit.cycles += 4;
+            return false;
+        case OP_JP:
+            x64_storeImm16(JIT_CPU, JIT_FIELD(PC), nn);
+            jit.cycles += 16;
+            return true;
+        case OP_JP_CC:
+            jit_emitBranch(instr, nn, next);
+            jit.cycles += 12;
+            return true;
+        case OP_JP_HL:
+            x64_loadU16(RAX, JIT_CPU, JIT_FIELD(HL));
+            x64_store16(JIT_CPU, JIT_FIELD(PC), RAX);
+            jit.cycles += 4;
+            return true;
+        case OP_JR:
+            x64_storeImm16(JIT_CPU, JIT_FIELD(PC), next + (int8)bytes[1]);
+            jit.cycles += 12;
+            return true;
+        case OP_JR_CC:
+            jit_emitBranch(instr, next + (int8)bytes[1], next);
+            jit.cycles += 8;
+            return true;
+        default:
+            break;
+    }
+    // the stack, the interrupt state and the rest of the control flow
+    jit_emitHandler(opcode, addr);
+    return true;
+}
+
+static void jit_emitReturn() {
+    x64_pop(JIT_NEXT_EVENT);
+    x64_pop(JIT_CYCLES);
+    x64_pop(JIT_CPU);
+    x64_ret();
+}
+
+// the code buffer is emptied once it is full, the hot blocks get recompiled as they run again
+static void jit_flush() {
+    jit_reset();
+    for (u32 i = 0; i < (1 << BLOCK_CACHE_BITS); i++) {
+        blockCache[i].native = NULL;
+        blockCache[i].numRuns = 0;
+    }
+}
+
+bool block_compile(cpu *cpu, block *b) {
+    u16 offset = 0;
+    u8 numInstrs = 0;
+    bool isPCSet = false;
+
+    if (!jit_init() || !jit_setWritable(true))
+        return false;
+    if (!jit_hasRoom(JIT_MAX_CODE_SIZE))
+        jit_flush();
+
+    u8 *start = jit_cursor();
+    jit.cpu = cpu;
+    jit.cycles = 0;
+    // an interrupt enabled by the previous block is taken after the first instruction
+    jit.isUnchecked = true;
+    jit.numExits = 0;
+
+    x64_push(JIT_CPU);
+    x64_push(JIT_CYCLES);
+    x64_push(JIT_NEXT_EVENT);
+    x64_movImm64(JIT_CPU, (u64)(uintptr_t)cpu);
+    x64_movImm64(JIT_CYCLES, (u64)(uintptr_t)&masterCycles);
+    x64_movImm64(JIT_NEXT_EVENT, (u64)(uintptr_t)&nextEventCycle);
+
+    // the fused pairs are translated as their two instructions
+    for (u8 i = 0; i < b->numInstrs; i++)
+        numInstrs += (b->opcodes[i] >= FUSED_OPCODE) ? 2 : 1;
+
+    for (u8 i = 0; i < numInstrs; i++) {
+        const u8 *bytes = &b->code[offset];
+        u16 opcode = (bytes[0] == 0xCB) ? 0x100 | bytes[1] : bytes[0];
+        const decodedInstr *instr = &decodedInstrs[opcode];
+
+        if (i != 0)
+            jit_checkContinue(b->addr + offset);
+        isPCSet = jit_translate(instr, opcode, bytes, b->addr + offset);
+        offset += instr->length;
+#ifdef DEBUG
+        jit_addCycles();
+        if (!isPCSet)
+            x64_storeImm16(JIT_CPU, JIT_FIELD(PC), b->addr + offset);
+        isPCSet = true;
+        x64_mov(RDI, JIT_CPU);
+        x64_movImm32(RSI, opcode);
+        x64_call(&jit_trace);
+        // printing TIMA syncs the timers
+        jit.isUnchecked = true;
+#endif
+    }
+
+    jit_addCycles();
+    if (!isPCSet)
+        x64_storeImm16(JIT_CPU, JIT_FIELD(PC), b->addr + offset);
+    // the ticks of the interpreter would have run the events that came due
+#ifndef BATCHED_TIMING
+    x64_call(&jit_catchUp);
+#endif
+    jit_emitReturn();
+
+    // the events that came due before an exit run there, as block_canContinue would run them
+    for (u8 i = 0; i < jit.numExits; i++) {
+        x64_patch(jit.exits[i].jump, jit_cursor());
+        if (jit.exits[i].cycles != 0)
+            x64_aluMem64(X64_ADD, JIT_CYCLES, 0, jit.exits[i].cycles);
+        x64_storeImm16(JIT_CPU, JIT_FIELD(PC), jit.exits[i].PC);
+        x64_call(&jit_catchUp);
+        jit_emitReturn();
+    }
+
+#ifdef PERF_MAP
+    char name[16];
+    snprintf(name, sizeof(name), "sm83_%04X", b->addr);
+    jit_name(start, name);
+#endif
+
+    // nothing can run from the buffer while it is writable
+    if (!jit_setWritable(false)) {
+        jit_flush();
+        return false;
+    }
+    b->native = (void (*)())start;
+    return true;
+}
+#endif
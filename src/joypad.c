@@ -14,26 +14,50 @@ static const unsigned char B_KEY = SDL_SCANCODE_W;
 static const unsigned char START_KEY = SDL_SCANCODE_D;
 static const unsigned char SELECT_KEY = SDL_SCANCODE_SPACE;
 
-static u8 joypad;
+// no keys pressed until the frontend reads the keyboard
+static u8 joypad = 0x0F;
+// keys held on the host, the lower nibble is the dpad and the upper one the buttons, in the order of the joypad bits
+static u8 pressedKeys;
 
 const unsigned char *keyboardArr = NULL;
 
-u8 joypad_read() {
+// the lower nibble only changes when the selection or the host keys do
+static void joypad_update() {
+    bool DPAD_SELECTED = !bit_read(joypad, 4);
+    bool SS_SELECTED = !bit_read(joypad, 5);
+    u8 pressed = (DPAD_SELECTED ? pressedKeys & 0x0F : 0) | (SS_SELECTED ? pressedKeys >> 4 : 0);
+    u8 oldJoypad = joypad;
+
+    joypad = (joypad & 0xF0) | (~pressed & 0x0F);
+
+    // interrupt on falling edge
+    if ((((~joypad) & 0x0F) & (oldJoypad & 0x0F)) != 0)
+        cpu_requestInterrupt(4);
+}
+
+static u8 joypad_read(u16 addr) {
     // when both dpad and Ssab are disabled, the lower nible is 0xF
     u8 val = ((joypad & 0x30) == 0x30) ? joypad | 0xF : joypad;
     return val;
 }
 
-void joypad_write(u8 data) { joypad = (data & 0xF0) | (joypad & 0x0F); }
+static void joypad_write(u16 addr, u8 data) {
+    joypad = (data & 0xF0) | (joypad & 0x0F);
+    joypad_update();
+}
+
+void joypad_mapIO() { bus_mapIO(0xFF00, &joypad_read, &joypad_write, 0xC0); }
 
-void joypad_init() { joypad = 0xCF; }
+void joypad_init() {
+    joypad = 0xCF;
+    pressedKeys = 0;
+}
 
+// called by the frontend once per frame, after it has handled the SDL events
 void joypad_readInput() {
     if (keyboardArr == NULL)
         return;
 
-    bool DPAD_SELECTED = !bit_read(joypad, 4);
-    bool SS_SELECTED = !bit_read(joypad, 5);
     // default no keys pressed
     bool right = false, left = false, up = false, down = false;
 
@@ -48,33 +72,10 @@ void joypad_readInput() {
     else if (keyboardArr[DOWN_KEY] == 1)
         down = true;
 
-    u8 oldJoypad = joypad;
-
-    // BIT0 - A | Right
-    if ((DPAD_SELECTED && right) || (SS_SELECTED && (keyboardArr[A_KEY] == 1)))
-        bit_clear(&joypad, 0);
-    else
-        bit_set(&joypad, 0);
-
-    // BIT1 - B | Left
-    if ((DPAD_SELECTED && left) || (SS_SELECTED && (keyboardArr[B_KEY] == 1)))
-        bit_clear(&joypad, 1);
-    else
-        bit_set(&joypad, 1);
-
-    // BIT2 - Up | Select
-    if ((DPAD_SELECTED && up) || (SS_SELECTED && (keyboardArr[START_KEY] == 1)))
-        bit_clear(&joypad, 2);
-    else
-        bit_set(&joypad, 2);
-
-    // BIT3 - Start | Down
-    if ((DPAD_SELECTED && down) || (SS_SELECTED && (keyboardArr[SELECT_KEY] == 1)))
-        bit_clear(&joypad, 3);
-    else
-        bit_set(&joypad, 3);
+    // BIT0 - A | Right, BIT1 - B | Left, BIT2 - Up | Select, BIT3 - Start | Down
+    pressedKeys = right | (left << 1) | (up << 2) | (down << 3);
+    pressedKeys |= ((keyboardArr[A_KEY] == 1) << 4) | ((keyboardArr[B_KEY] == 1) << 5);
+    pressedKeys |= ((keyboardArr[START_KEY] == 1) << 6) | ((keyboardArr[SELECT_KEY] == 1) << 7);
 
-    // interrupt on falling edge
-    if ((((~joypad) & 0x0F) & (oldJoypad & 0x0F)) != 0)
-        bit_set(&IF_register, 4);
+    joypad_update();
 }
@@ -3,8 +3,7 @@
 
 #include "types.h"
 
-u8 joypad_read();
-void joypad_write(u8 data);
+void joypad_mapIO();
 void joypad_init();
 void joypad_readInput();
 
@@ -1,6 +1,7 @@
 #include <SDL2/SDL.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "cartridge.h"
 #include "cpu.h"
@@ -15,27 +16,21 @@ void run_frame(SDL_Surface *surface) {
 #endif
     SDL_LockSurface(surface);
 
-    // if the ppu is already in VBLANK, run until it isn't
-    while (_ppu.currMode == MODE_1)
-#ifdef DEBUG
-        cpu_run(logFile);
-#else
-        cpu_run();
-#endif
-
     // once the ppu has entered VBLANK, we can draw the frame
-    while (_ppu.currMode != MODE_1) {
 #ifdef DEBUG
-        cpu_run(logFile);
+    cpu_runUntilVBlank(logFile);
 #else
-        cpu_run();
+    cpu_runUntilVBlank();
 #endif
-    }
     SDL_UnlockSurface(surface);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    // -i runs every instruction through the interpreter, without the block cache,
+    // -b keeps the block cache but doesn't recompile the hot blocks
+    bool interpreterOnly = argc == 3 && strcmp(argv[1], "-i") == 0;
+    bool blocksOnly = argc == 3 && strcmp(argv[1], "-b") == 0;
+    if (argc != 2 && !interpreterOnly && !blocksOnly) {
         printf("Invalid argument. \n");
         exit(0);
     }
@@ -57,8 +52,16 @@ int main(int argc, char *argv[]) {
 
     // init
     SDL_Init(SDL_INIT_VIDEO);
-    cartridge_load(argv[1]);
+    bus_init();
+    cartridge_load(argv[argc - 1]);
     cpu_init();
+    cpu_useBlockCache(!interpreterOnly);
+    cpu_useRecompiler(!interpreterOnly && !blocksOnly);
+
+    // the idle loop list sits next to the rom
+    char idleListPath[strlen(argv[argc - 1]) + sizeof(".idle")];
+    sprintf(idleListPath, "%s.idle", argv[argc - 1]);
+    cpu_loadIdleLoopList(idleListPath);
     ppu_init();
 
     // get keyboard array
@@ -83,6 +86,8 @@ int main(int argc, char *argv[]) {
                     break;
             }
         }
+        // the keyboard state only changes when the events are polled
+        joypad_readInput();
 
         endTicks = SDL_GetTicks();
 
@@ -97,6 +102,13 @@ int main(int argc, char *argv[]) {
         SDL_DestroyTexture(texture);
     }
 
+    printf("Cycles skipped in idle loops: %llu\n", (unsigned long long)cpu_idleCycles());
+#ifdef PROFILE_PAIRS
+    char pairsPath[strlen(argv[argc - 1]) + sizeof(".pairs")];
+    sprintf(pairsPath, "%s.pairs", argv[argc - 1]);
+    cpu_savePairCounts(pairsPath);
+#endif
+
     cartridge_free();
 
     SDL_DestroyRenderer(renderer);
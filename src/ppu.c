@@ -2,69 +2,152 @@
 #include "bus.h"
 #include "cpu.h"
 #include "screen.h"
+#include "timing.h"
 
 #include <assert.h>
+#include <string.h>
 
 ppu _ppu;
 static pixelFetcher _pixelFetcher;
 static pixelMixer _pixelMixer;
 static FIFO backgroundFIFO;
 static FIFO spriteFIFO;
-static OAM oam;
+OAM oam;
 u8 VRAM[0x2000];
+u64 vblankCount;
+
+// number of T cycles the ppu has been ticked for
+static u64 ppuCycles;
+static bool isSyncing;
+// set when the last tick changed the mode or LY, the interrupts are checked on the next one
+static bool isTransitionPending;
+// set by a register write, the STAT interrupt line is checked again on the next tick
+static bool isRegisterWritten;
+// set while the mode 3 of a line that was drawn at once, when the mode started, is running
+static bool isLineRendered;
+static u16 lineLength;
+static bool lineIncrWINDOW;
+// the pixels of that line, they reach the screen when its mode 3 ends
+static u8 linePixels[160];
+
+// mode 3 lasts as long on every line with the same SCX % 8, window start and sprite X positions
+typedef struct lineTiming {
+    // SCX % 8, window start (0xFF without the window), number of sprites and their X
+    u8 key[13];
+    u16 length;
+} lineTiming;
+
+static lineTiming lineTimings[64];
+
+// a bit for each sprite on each line 0-143, kept up to date with OAM and the sprite height
+static u64 lineSprites[144];
+// set when the sprites of the line were selected at once when mode 2 started,
+// the ticks of mode 2 then don't read OAM
+static bool isOAMScanned;
+
+// the 384 tiles decoded to color numbers per row, as stored and horizontally flipped,
+// a set bit in dirtyTileRows marks a row that was written since it was decoded
+static u8 tileRows[2][384][8][8];
+static u8 dirtyTileRows[384];
+// both tile maps drawn as 256x256 planes of color numbers, for each addressing mode,
+// a set bit in dirtyPlaneRows marks an 8 pixel tile of a plane row that has to be drawn again
+static u8 tileMapPlanes[2][2][256][256];
+static u32 dirtyPlaneRows[2][2][256];
+// for each tile map and tile number, a bit for each map entry that holds it, one word per row of the map
+static u32 tileMapUsers[2][256][32];
 
 static const u16 OAMstartingAddr = 0xFE00;
 
+// sets or clears the bit of a sprite (0-39) on the lines it covers with the current sprite height
+static void lineSprites_write(u8 idx, u8 Y, bool isOnLine) {
+    for (int16 LY = Y - 16; LY < Y - 16 + _ppu.control.spriteHeight; LY++) {
+        if (LY < 0 || LY > 143)
+            continue;
+        if (isOnLine)
+            lineSprites[LY] |= (u64)1 << idx;
+        else
+            lineSprites[LY] &= ~((u64)1 << idx);
+    }
+}
+
+static void lineSprites_rebuild() {
+    memset(lineSprites, 0, sizeof(lineSprites));
+    for (u8 i = 0; i < 40; i++)
+        lineSprites_write(i, oam.memory[4 * i], true);
+}
+
 static void DMA_writeREG(OAM *oam, u8 data) {
     oam->DMA_CTR_REGISTER = data;
     oam->state = ACTIVE;
     oam->sourceAddr = (oam->DMA_CTR_REGISTER << 8) & 0xFF00;
-    oam->destAddr = OAMstartingAddr;
-    oam->waitNumCycles = 4;
+    oam->startCycle = ppuCycles;
+    oam->numTransferred = 0;
+    // the cached blocks read their opcodes around the bus conflicts
+    cpu_endBlock();
+    // 4 cycles of delay and then one byte every 4 cycles
+    timing_schedule(EVENT_DMA, ppuCycles + 4 + 4 * 0xA0);
 }
 
-static void DMA_tick(OAM *oam) {
-    switch (oam->state) {
-        case INACTIVE:
-            return;
-        case ACTIVE:
-            if (oam->waitNumCycles != 0) {
-                oam->waitNumCycles--;
-                return;
-            }
-            oam->currTransByte = bus_read(oam->sourceAddr++, false);
-            bus_write(oam->destAddr++, oam->currTransByte, false);
+// a source in host memory only changes through the bus, which syncs the ppu before every write
+// while the DMA is active, so its bytes are copied at once when OAM is needed next
+static bool DMA_isTicked() { return oam.state == ACTIVE && readPages[oam.sourceAddr >> 8] == NULL; }
 
-            if (oam->destAddr > 0xFE9F) {
-                oam->state = INACTIVE;
-            }
-            oam->waitNumCycles = 3;
+// copies the bytes of the ticks before cycle
+static void DMA_catchUp(u64 cycle) {
+    u8 *source = readPages[oam.sourceAddr >> 8];
+    u64 numDue;
+
+    if (cycle <= oam.startCycle + 4)
+        return;
+    numDue = (cycle - oam.startCycle - 4 + 3) / 4;
+    if (numDue > 0xA0)
+        numDue = 0xA0;
+    if (numDue <= oam.numTransferred)
+        return;
+
+    if (source != NULL) {
+        memcpy(&oam.memory[oam.numTransferred], &source[oam.numTransferred], numDue - oam.numTransferred);
+        oam.numTransferred = numDue;
+        oam.currTransByte = oam.memory[numDue - 1];
+    }
+    else {
+        while (oam.numTransferred < numDue) {
+            oam.currTransByte = bus_readDMA(oam.sourceAddr + oam.numTransferred);
+            oam.memory[oam.numTransferred++] = oam.currTransByte;
+        }
     }
-}
 
-static void printInvalidAddr(u16 addr) {
-    printf("ERROR invalid ppu addr 0x%02X. \n", addr);
-    exit(0);
+    if (oam.numTransferred == 0xA0) {
+        oam.state = INACTIVE;
+        lineSprites_rebuild();
+    }
 }
 
 static void FIFO_reset(FIFO *FIFO) {
+    FIFO->low = 0;
+    FIFO->high = 0;
+    FIFO->palette = 0;
+    FIFO->backgroundPriority = 0;
     FIFO->numStoredPixels = 0;
-    FIFO->startIdx = 0;
-    FIFO->endIdx = 0;
 }
 
-static void FIFO_pop(FIFO *FIFO, pixelInFIFO *out) {
+// shifts out the color number of the next pixel
+static u8 FIFO_pop(FIFO *FIFO) {
     assert(FIFO->numStoredPixels != 0);
-    assert(FIFO->startIdx < 8);
-    *out = FIFO->pixels[FIFO->startIdx];
-    FIFO->startIdx = (FIFO->startIdx + 1) % 8;
+    u8 colorNumber = (bit_read(FIFO->high, 7) << 1) | bit_read(FIFO->low, 7);
+
+    FIFO->low <<= 1;
+    FIFO->high <<= 1;
+    FIFO->palette <<= 1;
+    FIFO->backgroundPriority <<= 1;
     FIFO->numStoredPixels--;
+    return colorNumber;
 }
 
-static void FIFO_placeSpritePixel(FIFO *FIFO, u8 colorNumber, sprite s, u8 idx) {
-    FIFO->pixels[idx].colorNumber = colorNumber;
-    FIFO->pixels[idx].palette = (!bit_read(s.flags, 4)) ? OBP0 : OBP1;
-    FIFO->pixels[idx].backgroundPriority = bit_read(s.flags, 7);
+static u8 reverseBits(u8 b) {
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    return (b & 0xAA) >> 1 | (b & 0x55) << 1;
 }
 
 static void pixelFetcher_setState(pixelFetcher *pixelFetcher, PIXELFETCHER_STATE state) {
@@ -98,28 +181,37 @@ static void scanLineEndReset(ppu *ppu, pixelFetcher *pixelFetcher, pixelMixer *p
 static sprite readSprite(u16 addr) {
     sprite s;
 
-    s.Y = bus_read(addr++, false);
-    s.X = bus_read(addr++, false);
-    s.tileNumber = bus_read(addr++, false);
-    s.flags = bus_read(addr, false);
+    s.Y = oam.memory[addr++ - OAMstartingAddr];
+    s.X = oam.memory[addr++ - OAMstartingAddr];
+    s.tileNumber = oam.memory[addr++ - OAMstartingAddr];
+    s.flags = oam.memory[addr - OAMstartingAddr];
 
     return s;
 };
 
 static void storeSpriteInBuffer(sprite s, ppu *ppu) { ppu->spriteBuffer.sprites[ppu->spriteBuffer.numStoredSprites++] = s; };
 
-static bool isTallSprite(ppu ppu) { return bit_read(ppu.LCDC_register, 2); };
-
-static ADDRESING_MODE whatAddrMode(ppu ppu) { return (bit_read(ppu.LCDC_register, 4)) ? MODE_8000 : MODE_8800; };
+static void ppu_decodeControl(ppu *ppu) {
+    ppuControl *control = &ppu->control;
+    const u8 palettes[3] = {[BGP] = ppu->BGP_register, [OBP0] = ppu->OBP0_register, [OBP1] = ppu->OBP1_register};
 
-static bool BGTileMapSelect(ppu ppu) {
-    // If it is set to 1, the background map located at $9C00-$9FFF is used, otherwise it uses the one at $9800-$9BFF
-    return bit_read(ppu.LCDC_register, 3);
-};
+    // If a map select bit is set to 1, the map located at $9C00-$9FFF is used, otherwise the one at $9800-$9BFF
+    control->BGTileMap = (bit_read(ppu->LCDC_register, 3)) ? 0x9C00 : 0x9800;
+    control->windowTileMap = (bit_read(ppu->LCDC_register, 6)) ? 0x9C00 : 0x9800;
+    control->addrMode = (bit_read(ppu->LCDC_register, 4)) ? MODE_8000 : MODE_8800;
+    control->spriteHeight = (bit_read(ppu->LCDC_register, 2)) ? 16 : 8;
+    control->isLCDEnabled = bit_read(ppu->LCDC_register, 7);
+    control->isWindowEnabled = bit_read(ppu->LCDC_register, 5);
+    control->isSpriteEnabled = bit_read(ppu->LCDC_register, 1);
+    control->isBackgroundEnabled = bit_read(ppu->LCDC_register, 0);
 
-static bool windowTileMapSelect(ppu ppu) {
-    // If it is set to 1, the background map located at $9C00-$9FFF is used, otherwise it uses the one at $9800-$9BFF
-    return bit_read(ppu.LCDC_register, 6);
+    // if color is 0 we need the 2 lsbs
+    // if color is 1 we need the next 2 bits left of the 2 lsbs(bits [3:1])
+    // so we need to shift the palette register right by colorNumber * 2 bits
+    for (u8 p = BGP; p <= OBP1; p++) {
+        for (u8 colorNumber = 0; colorNumber < 4; colorNumber++)
+            control->colors[p][colorNumber] = (palettes[p] >> (colorNumber * 2)) & 0x03;
+    }
 }
 
 static u8 getPixelFromRow(u8 rowLow, u8 rowHigh, u8 idx) {
@@ -128,30 +220,11 @@ static u8 getPixelFromRow(u8 rowLow, u8 rowHigh, u8 idx) {
     return (high << 1) | low;
 }
 
-static bool isInsideWindow(ppu *ppu) { return bit_read(ppu->LCDC_register, 5) && ppu->WY_equal_LY && (ppu->X_position + 7 >= ppu->WX_register); }
-
-static u8 decodePixel(pixelInFIFO pixel, ppu ppu) {
-    u8 reg;
-
-    switch (pixel.palette) {
-        default:
-        case BGP:
-            reg = ppu.BGP_register;
-            break;
-        case OBP0:
-            reg = ppu.OBP0_register;
-            break;
-        case OBP1:
-            reg = ppu.OBP1_register;
-            break;
-    }
+static bool isInsideWindow(ppu *ppu) { return ppu->control.isWindowEnabled && ppu->WY_equal_LY && (ppu->X_position + 7 >= ppu->WX_register); }
 
+static u8 decodePixel(pixelInFIFO pixel, ppu *ppu) {
     assert(pixel.colorNumber < 4);
-
-    // if color is 0 we need the 2 lsbs
-    // if color is 1 we need the next 2 bits left of the 2 lsbs(bits [3:1])
-    // so we need to shift the palette register right by colorNumber * 2 bits
-    return (reg >> (pixel.colorNumber * 2)) & 0x03;
+    return ppu->control.colors[pixel.palette][pixel.colorNumber];
 }
 
 // HBLANK
@@ -164,6 +237,9 @@ static void ppu_MODE0_tick(ppu *ppu, pixelFetcher *pixelFetcher, pixelMixer *pix
             ppu->currMode = MODE_1;
             // VBLANK interrupt
             ppu->triggerVBLANKintr = true;
+            // cpu_runUntilVBlank() returns after the current instruction
+            vblankCount++;
+            cpu_endBlock();
         }
         else {
             ppu->currMode = MODE_2;
@@ -195,13 +271,31 @@ static void ppu_MODE1_tick(ppu *ppu, pixelFetcher *pixelFetcher) {
     }
 };
 
+static void ppu_scanSprite(ppu *ppu, u16 addr) {
+    sprite s = readSprite(addr);
+    u8 spriteHeight = ppu->control.spriteHeight;
+
+    if (s.X > 0 && (ppu->LY_register + 16) >= s.Y && (ppu->LY_register + 16) < (s.Y + spriteHeight) && ppu->spriteBuffer.numStoredSprites < 10)
+        storeSpriteInBuffer(s, ppu);
+}
+
 static void ppu_MODE2_tick(ppu *ppu) {
     if (!ppu->isSecondCycle) {
-        sprite s = readSprite(ppu->MODE2addr);
-        u8 spriteHeight = (isTallSprite(*ppu)) ? 16 : 8;
-
-        if (s.X > 0 && (ppu->LY_register + 16) >= s.Y && (ppu->LY_register + 16) < (s.Y + spriteHeight) && ppu->spriteBuffer.numStoredSprites < 10)
-            storeSpriteInBuffer(s, ppu);
+        // while the DMA writes OAM, each sprite is read on its own tick
+        if (ppu->scanLineTicks == 0) {
+            isOAMScanned = oam.state == INACTIVE;
+            if (isOAMScanned) {
+                assert(ppu->LY_register < 144);
+                u64 sprites = lineSprites[ppu->LY_register];
+
+                for (u8 i = 0; sprites != 0; i++, sprites >>= 1) {
+                    if (sprites & 1)
+                        ppu_scanSprite(ppu, OAMstartingAddr + 4 * i);
+                }
+            }
+        }
+        if (!isOAMScanned)
+            ppu_scanSprite(ppu, ppu->MODE2addr);
 
         ppu->isSecondCycle = true;
         ppu->MODE2addr += 4;
@@ -224,31 +318,31 @@ static void pixelFetcher_fetchTileNum_tick(ppu *ppu, pixelFetcher *pixelFetcher)
             case BACKGROUND: {
                 u8 fetchX = (ppu->SCX_register / 8 + pixelFetcher->X_position) & 0x1F;
                 u8 fetchY = ((ppu->SCY_register + ppu->LY_register) & 0xFF) / 8;
-                u16 startingAddr = (BGTileMapSelect(*ppu)) ? 0x9C00 : 0x9800;
+                u16 startingAddr = ppu->control.BGTileMap;
 
                 assert(fetchX < 32);
                 assert(fetchY < 32);
 
                 u16 addr = startingAddr + ((32 * fetchY + fetchX) & 0x3FF);
 
-                tileNumber = bus_read(addr, false);
+                tileNumber = VRAM[addr - 0x8000];
                 break;
             }
             case WINDOW: {
                 u8 fetchX = pixelFetcher->X_position;
                 u8 fetchY = pixelFetcher->WINDOW_LINE_COUNTER / 8;
-                u16 startingAddr = (windowTileMapSelect(*ppu)) ? 0x9C00 : 0x9800;
+                u16 startingAddr = ppu->control.windowTileMap;
 
                 assert(fetchX < 32);
                 assert(fetchY < 32);
 
                 u16 addr = startingAddr + 32 * fetchY + fetchX;
 
-                tileNumber = bus_read(addr, false);
+                tileNumber = VRAM[addr - 0x8000];
                 break;
             }
             case SPRITE: {
-                if (isTallSprite(*ppu)) {
+                if (ppu->control.spriteHeight == 16) {
                     u8 tileRow = ppu->LY_register - (pixelFetcher->spriteToFetch.s.Y - 16);
                     bool isSpriteVFlipped = bit_read(pixelFetcher->spriteToFetch.s.flags, 6);
                     // if the sprite isn't flipped and row < 8 or
@@ -275,9 +369,11 @@ static void pixelFetcher_fetchTileNum_tick(ppu *ppu, pixelFetcher *pixelFetcher)
         pixelFetcher_setState(pixelFetcher, fetchTileDataLow);
 }
 
+static u16 tileDataAddr(ADDRESING_MODE mode, u8 tileNumber) { return (mode == MODE_8000) ? 0x8000 + 16 * tileNumber : 0x9000 + 16 * (int8)tileNumber; }
+
 static void pixelFetcher_fetchTileRowLow_tick(ppu *ppu, pixelFetcher *pixelFetcher) {
     if (!pixelFetcher->isSecondCycle) {
-        ADDRESING_MODE mode = (pixelFetcher->currFetching == SPRITE) ? MODE_8000 : whatAddrMode(*ppu);
+        ADDRESING_MODE mode = (pixelFetcher->currFetching == SPRITE) ? MODE_8000 : ppu->control.addrMode;
         u16 offset;
         u16 addr;
 
@@ -300,19 +396,10 @@ static void pixelFetcher_fetchTileRowLow_tick(ppu *ppu, pixelFetcher *pixelFetch
             }
         }
 
-        switch (mode) {
-            case MODE_8000:
-                addr = 0x8000 + 16 * pixelFetcher->fetchedTileNumber;
-                break;
-            case MODE_8800:
-                addr = 0x9000 + 16 * ((int8)pixelFetcher->fetchedTileNumber);
-                break;
-        }
-
-        addr += offset;
+        addr = tileDataAddr(mode, pixelFetcher->fetchedTileNumber) + offset;
 
         pixelFetcher->fetchTileAddr = addr;
-        pixelFetcher->fetchedRowLow = bus_read(addr, false);
+        pixelFetcher->fetchedRowLow = VRAM[addr - 0x8000];
 
         pixelFetcher->isSecondCycle = 1;
     }
@@ -322,7 +409,7 @@ static void pixelFetcher_fetchTileRowLow_tick(ppu *ppu, pixelFetcher *pixelFetch
 
 static void pixelFetcher_fetchTileRowHigh_tick(pixelFetcher *pixelFetcher) {
     if (!pixelFetcher->isSecondCycle) {
-        pixelFetcher->fetchedRowHigh = bus_read(++pixelFetcher->fetchTileAddr, false);
+        pixelFetcher->fetchedRowHigh = VRAM[++pixelFetcher->fetchTileAddr - 0x8000];
         pixelFetcher->isSecondCycle = 1;
     }
     else {
@@ -338,8 +425,6 @@ static void pixelFetcher_fetchTileRowHigh_tick(pixelFetcher *pixelFetcher) {
 }
 
 static void pixelFetcher_pushToFIFO_tick(pixelFetcher *pixelFetcher, FIFO *backgroundFIFO, FIFO *spriteFIFO) {
-    u8 i;
-
     // push
     if ((pixelFetcher->currFetching == BACKGROUND || pixelFetcher->currFetching == WINDOW)) {
         // if a sprite fetch has been requested, reset and start fetching the sprite
@@ -353,47 +438,39 @@ static void pixelFetcher_pushToFIFO_tick(pixelFetcher *pixelFetcher, FIFO *backg
         if (backgroundFIFO->numStoredPixels != 0)
             return;
 
-        for (i = 0; i < 8; i++) {
-            backgroundFIFO->pixels[backgroundFIFO->endIdx].colorNumber = getPixelFromRow(pixelFetcher->fetchedRowLow, pixelFetcher->fetchedRowHigh, 7 - i);
-            backgroundFIFO->pixels[backgroundFIFO->endIdx].palette = BGP;
-            backgroundFIFO->endIdx = (backgroundFIFO->endIdx + 1) % 8;
-        }
-
+        backgroundFIFO->low = pixelFetcher->fetchedRowLow;
+        backgroundFIFO->high = pixelFetcher->fetchedRowHigh;
         backgroundFIFO->numStoredPixels = 8;
         pixelFetcher->state = fetchTileNo;
         pixelFetcher->X_position++;
     }
     else if (pixelFetcher->currFetching == SPRITE) {
-        u8 pixels[8];
-
-        // a sprite can be partially displayed on the screen(when X < 8)
-        u8 numPixelsDisplayed = (pixelFetcher->spriteToFetch.s.X > 7) ? 8 : pixelFetcher->spriteToFetch.s.X;
-        u8 displayOffset = 8 - numPixelsDisplayed;
-        bool isSpriteHFlipped = bit_read(pixelFetcher->spriteToFetch.s.flags, 5);
+        sprite s = pixelFetcher->spriteToFetch.s;
+        u8 rowLow = pixelFetcher->fetchedRowLow;
+        u8 rowHigh = pixelFetcher->fetchedRowHigh;
 
-        // flip and crop pixels
-        if (isSpriteHFlipped) {
-            for (i = 0; i < numPixelsDisplayed; i++)
-                pixels[i] = getPixelFromRow(pixelFetcher->fetchedRowLow, pixelFetcher->fetchedRowHigh, displayOffset + i);
-        }
-        else {
-            for (i = 0; i < numPixelsDisplayed; i++)
-                pixels[i] = getPixelFromRow(pixelFetcher->fetchedRowLow, pixelFetcher->fetchedRowHigh, 7 - (i + displayOffset));
+        if (bit_read(s.flags, 5)) {
+            rowLow = reverseBits(rowLow);
+            rowHigh = reverseBits(rowHigh);
         }
 
-        for (i = 0; i < numPixelsDisplayed; i++) {
-            // first check if FIFO slot is empty
-            if (i >= spriteFIFO->numStoredPixels) {
-                FIFO_placeSpritePixel(spriteFIFO, pixels[i], pixelFetcher->spriteToFetch.s, spriteFIFO->endIdx);
-                spriteFIFO->numStoredPixels++;
-                spriteFIFO->endIdx = (spriteFIFO->endIdx + 1) % 8;
-            }
-            else if (spriteFIFO->pixels[(spriteFIFO->startIdx + i) % 8].colorNumber == 0 && pixels[i] != 0) {
-                // if not empty, check if the pixel in FIFO's slot is transparent(color == 0)
-                // if it is, and the new pixel isn't, replace the pixel in FIFO with the new one
-                FIFO_placeSpritePixel(spriteFIFO, pixels[i], pixelFetcher->spriteToFetch.s, (spriteFIFO->startIdx + i) % 8);
-            }
-        }
+        // a sprite can be partially displayed on the screen(when X < 8), the cropped pixels are shifted out
+        u8 displayOffset = (s.X > 7) ? 0 : 8 - s.X;
+        u8 displayed = 0xFF << displayOffset;
+        u8 stored = 0xFF00 >> spriteFIFO->numStoredPixels;
+
+        rowLow <<= displayOffset;
+        rowHigh <<= displayOffset;
+
+        // the new pixels fill the empty slots, and replace the transparent(color == 0) pixels in the FIFO with the ones that aren't
+        u8 placed = (displayed & ~stored) | (stored & ~(spriteFIFO->low | spriteFIFO->high) & (rowLow | rowHigh));
+
+        spriteFIFO->low = (spriteFIFO->low & ~placed) | (rowLow & placed);
+        spriteFIFO->high = (spriteFIFO->high & ~placed) | (rowHigh & placed);
+        spriteFIFO->palette = (spriteFIFO->palette & ~placed) | ((bit_read(s.flags, 4)) ? placed : 0);
+        spriteFIFO->backgroundPriority = (spriteFIFO->backgroundPriority & ~placed) | ((bit_read(s.flags, 7)) ? placed : 0);
+        if (spriteFIFO->numStoredPixels < 8 - displayOffset)
+            spriteFIFO->numStoredPixels = 8 - displayOffset;
 
         pixelFetcher->state = fetchTileNo;
         pixelFetcher->spriteToFetch.isCurrentlyFetching = false;
@@ -418,38 +495,49 @@ static void pixelFetcher_tick(ppu *ppu, pixelFetcher *pixelFetcher, FIFO *backgr
     }
 }
 
+// while a line is rendered its pixels are kept until its mode 3 ends
+static void pixelMixer_push(ppu *ppu, u8 pixel) {
+    if (isLineRendered)
+        linePixels[ppu->X_position] = pixel;
+    else
+        pushToScreen(pixel, ppu->X_position, ppu->LY_register);
+}
+
 static void pixelMixer_tick(ppu *ppu, pixelMixer *pixelMixer, FIFO *backgroundFIFO, FIFO *spriteFIFO) {
     switch (pixelMixer->state) {
         case STALLED:
             return;
         case P_ACTIVE: {
-            bool isBackgroundEnabled = bit_read(ppu->LCDC_register, 0);
+            bool isBackgroundEnabled = ppu->control.isBackgroundEnabled;
 
-            FIFO_pop(backgroundFIFO, &pixelMixer->backgroundPixel);
+            pixelMixer->backgroundPixel.colorNumber = FIFO_pop(backgroundFIFO);
+            pixelMixer->backgroundPixel.palette = BGP;
             assert(backgroundFIFO->numStoredPixels < 9);
 
             if (spriteFIFO->numStoredPixels == 0) {
                 // If the sprite FIFO doesn't have any pixels, the output pixel is the one shifted out of the background FIFO
                 // if background is not enabled, a blank pixel(0) is shifted out
                 if (isBackgroundEnabled)
-                    pushToScreen(decodePixel(pixelMixer->backgroundPixel, *ppu), ppu->X_position, ppu->LY_register);
+                    pixelMixer_push(ppu, decodePixel(pixelMixer->backgroundPixel, ppu));
                 else
-                    pushToScreen(0, ppu->X_position, ppu->LY_register);
+                    pixelMixer_push(ppu, 0);
             }
             else {
-                bool isSpriteEnabled = bit_read(ppu->LCDC_register, 1);
+                bool isSpriteEnabled = ppu->control.isSpriteEnabled;
 
-                FIFO_pop(spriteFIFO, &pixelMixer->spritePixel);
+                pixelMixer->spritePixel.palette = (bit_read(spriteFIFO->palette, 7)) ? OBP1 : OBP0;
+                pixelMixer->spritePixel.backgroundPriority = bit_read(spriteFIFO->backgroundPriority, 7);
+                pixelMixer->spritePixel.colorNumber = FIFO_pop(spriteFIFO);
 
                 if (((pixelMixer->spritePixel.colorNumber == 0 || (pixelMixer->spritePixel.backgroundPriority && (pixelMixer->backgroundPixel.colorNumber != 0))) && isBackgroundEnabled) ||
                     !isSpriteEnabled) {
                     if (isBackgroundEnabled)
-                        pushToScreen(decodePixel(pixelMixer->backgroundPixel, *ppu), ppu->X_position, ppu->LY_register);
+                        pixelMixer_push(ppu, decodePixel(pixelMixer->backgroundPixel, ppu));
                     else
-                        pushToScreen(0, ppu->X_position, ppu->LY_register);
+                        pixelMixer_push(ppu, 0);
                 }
                 else
-                    pushToScreen(decodePixel(pixelMixer->spritePixel, *ppu), ppu->X_position, ppu->LY_register);
+                    pixelMixer_push(ppu, decodePixel(pixelMixer->spritePixel, ppu));
             }
             ppu->X_position++;
             break;
@@ -482,7 +570,7 @@ static void ppu_MODE3_tick(ppu *ppu, pixelMixer *pixelMixer, pixelFetcher *pixel
         assert(backgroundFIFO->numStoredPixels > scx_mod);
 
         for (u8 i = 0; i < scx_mod; i++)
-            FIFO_pop(backgroundFIFO, &(pixelMixer->backgroundPixel));
+            FIFO_pop(backgroundFIFO);
 
         assert(backgroundFIFO->numStoredPixels < 9);
 
@@ -539,104 +627,385 @@ static void ppu_MODE3_tick(ppu *ppu, pixelMixer *pixelMixer, pixelFetcher *pixel
         ppu->currMode = MODE_0;
 };
 
+// the inputs of the interrupt line (LY, LYC, the mode and STAT) only change on a transition or a register write
 static void trigger_intr(ppu *ppu) {
-    // TODO update OR only when a value changes
     bit_write(&ppu->STAT_register, 2, ppu->LYC_register == ppu->LY_register);
 
     bool new_stat_0R = (bit_read(ppu->STAT_register, 6) && (ppu->LY_register == ppu->LYC_register)) || (bit_read(ppu->STAT_register, 5) && ((ppu->currMode == MODE_2) || (ppu->LY_register == 144))) ||
                        (bit_read(ppu->STAT_register, 4) && (ppu->currMode == MODE_1)) || (bit_read(ppu->STAT_register, 3) && (ppu->currMode == MODE_0));
 
     if (!ppu->stat_OR && new_stat_0R)
-        bit_set(&IF_register, 1);
+        cpu_requestInterrupt(1);
 
     if (ppu->triggerVBLANKintr) {
         ppu->triggerVBLANKintr = false;
-        bit_set(&IF_register, 0);
+        cpu_requestInterrupt(0);
     }
 
     ppu->stat_OR = new_stat_0R;
 }
 
-u8 oam_read(u16 addr) {
-    // TODO DMA blocking
-    return oam.memory[addr - OAMstartingAddr];
+// the color numbers of the tile row at addr (its low byte)
+static const u8 *tileCache_read(u16 addr, bool isFlipped) {
+    u16 tile = (addr - 0x8000) / 16;
+    u8 row = (addr % 16) / 2;
+
+    if (bit_read(dirtyTileRows[tile], row)) {
+        for (u8 i = 0; i < 8; i++) {
+            tileRows[0][tile][row][i] = getPixelFromRow(VRAM[addr - 0x8000], VRAM[addr + 1 - 0x8000], 7 - i);
+            tileRows[1][tile][row][i] = getPixelFromRow(VRAM[addr - 0x8000], VRAM[addr + 1 - 0x8000], i);
+        }
+        bit_clear(&dirtyTileRows[tile], row);
+    }
+    return tileRows[isFlipped][tile][row];
 }
 
-void oam_write(u16 addr, u8 data) { oam.memory[addr - OAMstartingAddr] = data; }
-
-u8 read_ppu(u16 addr) {
-    switch (addr) {
-        case 0xFF40:
-            return _ppu.LCDC_register;
-        case 0xFF41:
-            return _ppu.STAT_register;
-        case 0xFF42:
-            return _ppu.SCY_register;
-        case 0xFF43:
-            return _ppu.SCX_register;
-        case 0xFF44:
-            return _ppu.LY_register;
-        case 0xFF45:
-            return _ppu.LYC_register;
-        case 0xFF46:
-            return oam.DMA_CTR_REGISTER;
-        case 0xFF47:
-            return _ppu.BGP_register;
-        case 0xFF48:
-            return _ppu.OBP0_register;
-        case 0xFF49:
-            return _ppu.OBP1_register;
-        case 0xFF4A:
-            return _ppu.WY_register;
-        case 0xFF4B:
-            return _ppu.WX_register;
-        default:
-            printInvalidAddr(addr);
-            return 0;
+// a row of a tile map plane, the tiles that changed since it was last read are drawn again
+static const u8 *tileMapPlane_row(bool map, ADDRESING_MODE mode, u8 y) {
+    u32 dirty = dirtyPlaneRows[map][mode][y];
+
+    if (dirty != 0) {
+        for (u8 tileX = 0; tileX < 32; tileX++) {
+            if ((dirty >> tileX) & 1) {
+                u8 tileNumber = VRAM[0x1800 + 0x400 * map + 32 * (y / 8) + tileX];
+
+                memcpy(&tileMapPlanes[map][mode][y][8 * tileX], tileCache_read(tileDataAddr(mode, tileNumber) + 2 * (y % 8), false), 8);
+            }
+        }
+        dirtyPlaneRows[map][mode][y] = 0;
     }
+    return tileMapPlanes[map][mode][y];
 }
 
-void write_ppu(u16 addr, u8 data) {
-    switch (addr) {
-        case 0xFF40:
-            _ppu.LCDC_register = data;
-            break;
-        case 0xFF41:
-            _ppu.STAT_register = (data & 0xFC) | (_ppu.STAT_register & 0x83);
-            break;
-        case 0xFF42:
-            _ppu.SCY_register = data;
-            break;
-        case 0xFF43:
-            _ppu.SCX_register = data;
-            break;
-        case 0xFF44:
-            _ppu.LY_register = data;
-            break;
-        case 0xFF45:
-            _ppu.LYC_register = data;
-            break;
-        case 0xFF46:
-            DMA_writeREG(&oam, data);
-            break;
-        case 0xFF47:
-            _ppu.BGP_register = data;
-            break;
-        case 0xFF48:
-            _ppu.OBP0_register = data;
-            break;
-        case 0xFF49:
-            _ppu.OBP1_register = data;
+// marks the plane tiles that show a row of tile data (0-383) that was written
+static void tileMapPlane_tileWritten(u16 tile, u8 row) {
+    for (ADDRESING_MODE mode = MODE_8000; mode <= MODE_8800; mode++) {
+        // tiles 0-255 are at 0x8000 + 16 * tileNumber, tiles 128-383 at 0x9000 + 16 * (int8)tileNumber
+        if ((mode == MODE_8000 && tile >= 256) || (mode == MODE_8800 && tile < 128))
+            continue;
+
+        u8 tileNumber = tile % 256;
+        for (u8 map = 0; map < 2; map++) {
+            for (u8 mapY = 0; mapY < 32; mapY++)
+                dirtyPlaneRows[map][mode][8 * mapY + row] |= tileMapUsers[map][tileNumber][mapY];
+        }
+    }
+}
+
+// marks the plane tile of a tile map entry (0x9800-0x9FFF) that is written
+static void tileMapPlane_entryWritten(u16 addr, u8 tileNumber) {
+    bool map = addr >= 0x9C00;
+    u16 entry = (addr - 0x9800) % 0x400;
+    u8 oldTileNumber = VRAM[addr - 0x8000];
+
+    tileMapUsers[map][oldTileNumber][entry / 32] &= ~(1u << (entry % 32));
+    tileMapUsers[map][tileNumber][entry / 32] |= 1u << (entry % 32);
+
+    for (u8 row = 0; row < 8; row++) {
+        dirtyPlaneRows[map][MODE_8000][8 * (entry / 32) + row] |= 1u << (entry % 32);
+        dirtyPlaneRows[map][MODE_8800][8 * (entry / 32) + row] |= 1u << (entry % 32);
+    }
+}
+
+// the X the window is fetched at, or -1 when it isn't on this line
+static int16 windowStart(ppu *ppu) {
+    if (!ppu->control.isWindowEnabled || !(ppu->WY_equal_LY || ppu->WY_register == ppu->LY_register) || ppu->WX_register > 166)
+        return -1;
+    return (ppu->WX_register < 7) ? 0 : ppu->WX_register - 7;
+}
+
+// the first X a sprite is drawn at, its fetch is requested there
+static u8 spriteStart(sprite s) { return (s.X > 8) ? s.X - 8 : 0; }
+
+// draws the same pixels as the FIFOs into linePixels, when nothing is written to the ppu during mode 3
+static void ppu_renderLine(ppu *ppu, pixelFetcher *pixelFetcher, int16 windowX) {
+    u8 colorNumbers[160];
+    pixelInFIFO spritePixels[160];
+    bool isSpritePixel[160] = {false};
+    ADDRESING_MODE mode = ppu->control.addrMode;
+    u8 LY = ppu->LY_register;
+    const u8 *row = NULL;
+    u8 x, i;
+
+    // background, the first SCX % 8 pixels are discarded
+    const u8 *planeRow = tileMapPlane_row(ppu->control.BGTileMap == 0x9C00, mode, ppu->SCY_register + LY);
+    u8 backgroundEnd = (windowX < 0) ? 160 : windowX;
+    u16 beforeWrap = 256 - ppu->SCX_register;
+
+    if (beforeWrap >= backgroundEnd)
+        memcpy(colorNumbers, planeRow + ppu->SCX_register, backgroundEnd);
+    else {
+        memcpy(colorNumbers, planeRow + ppu->SCX_register, beforeWrap);
+        memcpy(colorNumbers + beforeWrap, planeRow, backgroundEnd - beforeWrap);
+    }
+
+    // window
+    planeRow = tileMapPlane_row(ppu->control.windowTileMap == 0x9C00, mode, pixelFetcher->WINDOW_LINE_COUNTER);
+    memcpy(colorNumbers + backgroundEnd, planeRow, 160 - backgroundEnd);
+
+    // sprites are fetched in the order of the X they are requested at, then in the order of the buffer
+    u8 order[10];
+    u8 numSprites = ppu->spriteBuffer.numStoredSprites;
+
+    for (i = 0; i < numSprites; i++) {
+        u8 j = i;
+
+        for (; j > 0 && spriteStart(ppu->spriteBuffer.sprites[order[j - 1]]) > spriteStart(ppu->spriteBuffer.sprites[i]); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for (i = 0; i < numSprites; i++) {
+        sprite s = ppu->spriteBuffer.sprites[order[i]];
+        u8 tileNumber = s.tileNumber;
+        u8 numPixelsDisplayed = (s.X > 7) ? 8 : s.X;
+        u8 displayOffset = 8 - numPixelsDisplayed;
+        u8 startX = spriteStart(s);
+        u8 tileRow = LY - (s.Y - 16);
+        bool isSpriteVFlipped = bit_read(s.flags, 6);
+
+        if (startX >= 160)
+            continue;
+
+        if (ppu->control.spriteHeight == 16)
+            tileNumber = ((tileRow < 8 && !isSpriteVFlipped) || (tileRow > 7 && isSpriteVFlipped)) ? tileNumber & 0xFE : tileNumber | 1;
+        u8 offset = 2 * (tileRow % 8);
+        if (isSpriteVFlipped)
+            offset = 14 - offset;
+        row = tileCache_read(0x8000 + 16 * tileNumber + offset, bit_read(s.flags, 5));
+
+        for (u8 j = 0; j < numPixelsDisplayed && startX + j < 160; j++) {
+            u8 colorNumber = row[displayOffset + j];
+            pixelInFIFO *pixel = &spritePixels[startX + j];
+
+            // a new pixel only replaces a transparent one
+            if (!isSpritePixel[startX + j] || (pixel->colorNumber == 0 && colorNumber != 0)) {
+                isSpritePixel[startX + j] = true;
+                pixel->colorNumber = colorNumber;
+                pixel->palette = (!bit_read(s.flags, 4)) ? OBP0 : OBP1;
+                pixel->backgroundPriority = bit_read(s.flags, 7);
+            }
+        }
+    }
+
+    // mix
+    bool isBackgroundEnabled = ppu->control.isBackgroundEnabled;
+    bool isSpriteEnabled = ppu->control.isSpriteEnabled;
+
+    for (x = 0; x < 160; x++) {
+        pixelInFIFO backgroundPixel = {.colorNumber = colorNumbers[x], .palette = BGP};
+        pixelInFIFO *spritePixel = &spritePixels[x];
+
+        if (isSpritePixel[x] && !(((spritePixel->colorNumber == 0 || (spritePixel->backgroundPriority && colorNumbers[x] != 0)) && isBackgroundEnabled) || !isSpriteEnabled))
+            linePixels[x] = decodePixel(*spritePixel, ppu);
+        else if (isBackgroundEnabled)
+            linePixels[x] = decodePixel(backgroundPixel, ppu);
+        else
+            linePixels[x] = 0;
+    }
+}
+
+// draws the line into linePixels when its mode 3 starts, the length of the mode is measured
+// the first time a line with the same timing runs through the FIFOs
+static void ppu_startLine() {
+    int16 windowX = windowStart(&_ppu);
+    u8 key[13] = {_ppu.SCX_register % 8, (windowX < 0) ? 0xFF : windowX, _ppu.spriteBuffer.numStoredSprites};
+    u8 hash = 0;
+
+    for (u8 i = 0; i < _ppu.spriteBuffer.numStoredSprites; i++)
+        key[3 + i] = _ppu.spriteBuffer.sprites[i].X;
+    for (u8 i = 0; i < 13; i++)
+        hash = hash * 31 + key[i];
+
+    lineTiming *timing = &lineTimings[hash % 64];
+
+    isLineRendered = true;
+    if (timing->length != 0 && memcmp(timing->key, key, 13) == 0)
+        ppu_renderLine(&_ppu, &_pixelFetcher, windowX);
+    else {
+        ppu p = _ppu;
+        pixelFetcher f = _pixelFetcher;
+        pixelMixer m = _pixelMixer;
+        FIFO b = backgroundFIFO;
+        FIFO s = spriteFIFO;
+
+        timing->length = 0;
+        while (p.currMode == MODE_3) {
+            ppu_MODE3_tick(&p, &m, &f, &b, &s);
+            timing->length++;
+        }
+        assert(f.incrWINDOW == (windowX >= 0));
+        memcpy(timing->key, key, 13);
+    }
+
+    lineLength = timing->length;
+    lineIncrWINDOW = windowX >= 0;
+}
+
+// until mode 3 of a rendered line ends only scanLineTicks changes,
+// STAT and the interrupt line are the same after its first tick
+static void ppu_runRenderedLine() {
+    u64 ticks = 80 + lineLength - _ppu.scanLineTicks;
+
+    if (ticks > masterCycles - ppuCycles)
+        ticks = masterCycles - ppuCycles;
+
+    if (_ppu.scanLineTicks == 80) {
+        trigger_intr(&_ppu);
+        isRegisterWritten = false;
+        _ppu.STAT_register = (_ppu.STAT_register & 0xFC) | MODE_3;
+        if (_ppu.WY_register == _ppu.LY_register)
+            _ppu.WY_equal_LY = true;
+    }
+
+    _ppu.scanLineTicks += ticks;
+    ppuCycles += ticks;
+    isTransitionPending = false;
+
+    if (_ppu.scanLineTicks == 80 + lineLength) {
+        // the rest of the fetcher state is reset at the end of the line
+        _ppu.X_position = 160;
+        _ppu.firstTimeInScanline = false;
+        _ppu.currMode = MODE_0;
+        _pixelFetcher.incrWINDOW = lineIncrWINDOW;
+        isLineRendered = false;
+        for (u8 x = 0; x < 160; x++)
+            pushToScreen(linePixels[x], x, _ppu.LY_register);
+        isTransitionPending = true;
+    }
+}
+
+// a write during mode 3 of a rendered line can change the rest of it, linePixels is dropped
+// and the FIFOs draw the line again up to the current cycle and from here on
+static void ppu_syncForWrite() {
+    ppu_sync();
+    if (!isLineRendered)
+        return;
+
+    u16 ticks = _ppu.scanLineTicks - 80;
+
+    isLineRendered = false;
+    _ppu.scanLineTicks = 80;
+    for (u16 i = 0; i < ticks; i++)
+        ppu_MODE3_tick(&_ppu, &_pixelMixer, &_pixelFetcher, &backgroundFIFO, &spriteFIFO);
+}
+
+// the interrupts only change on a mode transition (or on a new LY),
+// so the ppu only has to be synced on the cycle after one
+static void ppu_scheduleNext() {
+    u64 cyclesToTransition;
+
+    if (!_ppu.control.isLCDEnabled) {
+        timing_cancel(EVENT_PPU);
+        return;
+    }
+
+    if (isTransitionPending) {
+        timing_schedule(EVENT_PPU, ppuCycles + 1);
+        return;
+    }
+
+    switch (_ppu.currMode) {
+        default:
+        case MODE_2:
+            cyclesToTransition = 80 - _ppu.scanLineTicks;
             break;
-        case 0xFF4A:
-            _ppu.WY_register = data;
+        case MODE_3:
+            // at most one pixel is pushed every cycle, unless the line was rendered
+            cyclesToTransition = (isLineRendered) ? 80 + lineLength - _ppu.scanLineTicks : 160 - _ppu.X_position;
             break;
-        case 0xFF4B:
-            _ppu.WX_register = data;
+        case MODE_0:
+        case MODE_1:
+            cyclesToTransition = 456 - _ppu.scanLineTicks;
             break;
-        default:
-            printInvalidAddr(addr);
     }
+    timing_schedule(EVENT_PPU, ppuCycles + cyclesToTransition + 1);
+}
+
+u8 oam_read(u16 addr) {
+    ppu_sync();
+    return oam.memory[addr - OAMstartingAddr];
+}
+
+// a write during mode 2 can change the sprites that are read after it, the ones read so far
+// are selected again and the rest of the scan reads one sprite per tick
+static void ppu_stopOAMScan() {
+    if (!isOAMScanned || _ppu.currMode != MODE_2)
+        return;
+
+    isOAMScanned = false;
+    _ppu.spriteBuffer.numStoredSprites = 0;
+    for (u16 addr = OAMstartingAddr; addr < _ppu.MODE2addr; addr += 4)
+        ppu_scanSprite(&_ppu, addr);
+}
+
+void oam_write(u16 addr, u8 data) {
+    // the sprites of a rendered line are already in the buffer
+    ppu_sync();
+    ppu_stopOAMScan();
+    if ((addr - OAMstartingAddr) % 4 == 0) {
+        lineSprites_write((addr - OAMstartingAddr) / 4, oam.memory[addr - OAMstartingAddr], false);
+        lineSprites_write((addr - OAMstartingAddr) / 4, data, true);
+    }
+    oam.memory[addr - OAMstartingAddr] = data;
+}
+
+void vram_write(u16 addr, u8 data) {
+    ppu_syncForWrite();
+    if (addr < 0x9800) {
+        bit_set(&dirtyTileRows[(addr - 0x8000) / 16], (addr % 16) / 2);
+        tileMapPlane_tileWritten((addr - 0x8000) / 16, (addr % 16) / 2);
+    }
+    else if (VRAM[addr - 0x8000] != data)
+        tileMapPlane_entryWritten(addr, data);
+    VRAM[addr - 0x8000] = data;
+}
+
+// registers 0xFF40-0xFF4B
+static u8 *const ppuRegisters[0x0C] = {
+    &_ppu.LCDC_register, &_ppu.STAT_register, &_ppu.SCY_register, &_ppu.SCX_register, &_ppu.LY_register, &_ppu.LYC_register,
+    &oam.DMA_CTR_REGISTER, &_ppu.BGP_register, &_ppu.OBP0_register, &_ppu.OBP1_register, &_ppu.WY_register, &_ppu.WX_register,
+};
+
+static u8 ppu_readRegister(u16 addr) {
+    ppu_sync();
+    return *ppuRegisters[addr - 0xFF40];
+}
+
+static void ppu_writeRegister(u16 addr, u8 data) {
+    bool isHeightChanged = addr == 0xFF40 && bit_read(data ^ _ppu.LCDC_register, 2);
+
+    ppu_syncForWrite();
+    if (isHeightChanged)
+        ppu_stopOAMScan();
+    *ppuRegisters[addr - 0xFF40] = data;
+    ppu_decodeControl(&_ppu);
+    if (isHeightChanged)
+        lineSprites_rebuild();
+    // the STAT interrupt line is evaluated again on the next cycle
+    isRegisterWritten = true;
+    timing_schedule(EVENT_PPU, ppuCycles + 1);
+}
+
+static void STAT_write(u16 addr, u8 data) {
+    ppu_syncForWrite();
+    _ppu.STAT_register = (data & 0xFC) | (_ppu.STAT_register & 0x83);
+    isRegisterWritten = true;
+    timing_schedule(EVENT_PPU, ppuCycles + 1);
+}
+
+static void DMA_write(u16 addr, u8 data) {
+    ppu_syncForWrite();
+    ppu_stopOAMScan();
+    DMA_writeREG(&oam, data);
+    timing_schedule(EVENT_PPU, ppuCycles + 1);
+}
+
+void ppu_mapIO() {
+    for (u16 addr = 0xFF40; addr <= 0xFF4B; addr++)
+        bus_mapIO(addr, &ppu_readRegister, &ppu_writeRegister, 0x00);
+    bus_mapIO(0xFF41, &ppu_readRegister, &STAT_write, 0x80);
+    bus_mapIO(0xFF46, &ppu_readRegister, &DMA_write, 0x00);
 }
 
 void ppu_init() {
@@ -659,6 +1028,7 @@ void ppu_init() {
     _ppu.stat_OR = false;
     _ppu.firstTimeInScanline = true;
     _ppu.triggerVBLANKintr = false;
+    ppu_decodeControl(&_ppu);
 
     FIFO_reset(&backgroundFIFO);
     FIFO_reset(&spriteFIFO);
@@ -678,12 +1048,25 @@ void ppu_init() {
     _pixelMixer.state = STALLED;
 
     oam.state = INACTIVE;
+
+    lineSprites_rebuild();
+    memset(dirtyTileRows, 0xFF, sizeof(dirtyTileRows));
+    memset(dirtyPlaneRows, 0xFF, sizeof(dirtyPlaneRows));
+    memset(tileMapUsers, 0, sizeof(tileMapUsers));
+    for (u16 entry = 0; entry < 0x800; entry++)
+        tileMapUsers[entry / 0x400][VRAM[0x1800 + entry]][entry % 0x400 / 32] |= 1u << (entry % 32);
+
+    ppuCycles = masterCycles;
+    // the first tick writes the mode to STAT
+    isTransitionPending = true;
+    ppu_scheduleNext();
 }
 
-void ppu_tick() {
-    DMA_tick(&oam);
+static void ppu_tick() {
+    if (oam.state == ACTIVE)
+        DMA_catchUp(ppuCycles + 1);
     // if turned off do nothing
-    if (!bit_read(_ppu.LCDC_register, 7)) {
+    if (!_ppu.control.isLCDEnabled) {
         _ppu.LY_register = 0x00;
         _ppu.currMode = MODE_0;
         bit_clear(&_ppu.STAT_register, 0);
@@ -691,29 +1074,90 @@ void ppu_tick() {
         return;
     }
 
-    trigger_intr(&_ppu);
+    if (isTransitionPending || isRegisterWritten) {
+        trigger_intr(&_ppu);
+        isRegisterWritten = false;
+    }
+
+    // the mode in STAT changes on the tick after a transition
+    if (isTransitionPending)
+        _ppu.STAT_register = (_ppu.STAT_register & 0xFC) | _ppu.currMode;
 
-    // TODO update mode of STAT only when the mode changes
     switch (_ppu.currMode) {
         case MODE_2: // OAM Scan - 80 TCycles
-            bit_clear(&_ppu.STAT_register, 0);
-            bit_set(&_ppu.STAT_register, 1);
             ppu_MODE2_tick(&_ppu);
             break;
         case MODE_3: // Drawing
-            bit_set(&_ppu.STAT_register, 0);
-            bit_set(&_ppu.STAT_register, 1);
             ppu_MODE3_tick(&_ppu, &_pixelMixer, &_pixelFetcher, &backgroundFIFO, &spriteFIFO);
             break;
         case MODE_0: // HBlank - pad scanline to 456 TCycles
-            bit_clear(&_ppu.STAT_register, 0);
-            bit_clear(&_ppu.STAT_register, 1);
             ppu_MODE0_tick(&_ppu, &_pixelFetcher, &_pixelMixer, &backgroundFIFO, &spriteFIFO);
             break;
         case MODE_1: // VBlank 10x456 = 4560 TCycles
-            bit_set(&_ppu.STAT_register, 0);
-            bit_clear(&_ppu.STAT_register, 1);
             ppu_MODE1_tick(&_ppu, &_pixelFetcher);
             break;
     }
 }
+
+void ppu_sync() {
+    // the DMA may read OAM through the bus while the ppu is being synced
+    if (isSyncing)
+        return;
+    isSyncing = true;
+
+    while (ppuCycles < masterCycles) {
+        if (!isLineRendered && _ppu.currMode == MODE_3 && _ppu.scanLineTicks == 80 && _ppu.X_position == 0 && !DMA_isTicked() && _ppu.control.isLCDEnabled)
+            ppu_startLine();
+        if (isLineRendered) {
+            ppu_runRenderedLine();
+            continue;
+        }
+
+        PPU_MODE prevMode = _ppu.currMode;
+        u8 prevLY = _ppu.LY_register;
+
+        ppu_tick();
+        ppuCycles++;
+
+        isTransitionPending = _ppu.currMode != prevMode || _ppu.LY_register != prevLY;
+
+        // while the LCD is off, or during HBLANK and VBLANK, every tick after the first one
+        // only increments scanLineTicks, until the next transition, and so does OAM scan once the sprites are selected
+        if (!DMA_isTicked() && !isTransitionPending) {
+            if (!_ppu.control.isLCDEnabled)
+                ppuCycles = masterCycles;
+            else if (_ppu.currMode == MODE_2 && isOAMScanned && _ppu.scanLineTicks < 79) {
+                u64 skip = 79 - _ppu.scanLineTicks;
+
+                if (skip > masterCycles - ppuCycles)
+                    skip = masterCycles - ppuCycles;
+                _ppu.scanLineTicks += skip;
+                ppuCycles += skip;
+                // a sprite is read on the first of every 2 ticks
+                _ppu.MODE2addr = OAMstartingAddr + 4 * ((_ppu.scanLineTicks + 1) / 2);
+                _ppu.isSecondCycle = _ppu.scanLineTicks % 2;
+            }
+            else if (_ppu.currMode == MODE_0 || _ppu.currMode == MODE_1) {
+                u64 skip = 455 - _ppu.scanLineTicks;
+
+                if (skip > masterCycles - ppuCycles)
+                    skip = masterCycles - ppuCycles;
+                _ppu.scanLineTicks += skip;
+                ppuCycles += skip;
+            }
+        }
+    }
+
+    if (oam.state == ACTIVE)
+        DMA_catchUp(ppuCycles);
+    if (oam.state == INACTIVE)
+        timing_cancel(EVENT_DMA);
+    ppu_scheduleNext();
+
+    isSyncing = false;
+}
+
+PPU_MODE ppu_currMode() {
+    ppu_sync();
+    return _ppu.currMode;
+}
@@ -27,6 +27,21 @@ typedef struct spriteBuffer {
     u8 numStoredSprites;
 } spriteBuffer;
 
+// LCDC and the palettes decoded, rebuilt when they are written
+typedef struct ppuControl {
+    u16 BGTileMap;
+    u16 windowTileMap;
+    // tile data at 0x8000 with unsigned tile numbers or at 0x9000 with signed ones
+    ADDRESING_MODE addrMode;
+    u8 spriteHeight;
+    bool isLCDEnabled;
+    bool isWindowEnabled;
+    bool isSpriteEnabled;
+    bool isBackgroundEnabled;
+    // the color of each color number, for BGP, OBP0 and OBP1
+    u8 colors[3][4];
+} ppuControl;
+
 typedef struct {
     u8 LY_register;
     u8 X_position;
@@ -43,6 +58,7 @@ typedef struct {
     u8 BGP_register;
     u8 OBP0_register;
     u8 OBP1_register;
+    ppuControl control;
     spriteBuffer spriteBuffer;
 
     u16 scanLineTicks;
@@ -72,12 +88,14 @@ typedef struct {
     u8 waitNumCycles;
 } pixelMixer;
 
-// typical ring/circular buffer
+// the bitplanes of the pixels as shift registers, the next pixel out is bit 7
 typedef struct {
-    pixelInFIFO pixels[8];
+    u8 low;
+    u8 high;
+    // sprite FIFO only, the bits of the pixels that use OBP1 and of the ones behind the background
+    u8 palette;
+    u8 backgroundPriority;
 
-    u8 startIdx;
-    u8 endIdx;
     u8 numStoredPixels;
 } FIFO;
 
@@ -109,24 +127,30 @@ typedef struct pixelFetcher {
 
 typedef struct OAM {
     u8 memory[0xA0];
-    u8 waitNumCycles;
     u8 currTransByte;
     u8 DMA_CTR_REGISTER;
+    // bytes of the DMA copied to memory so far
+    u8 numTransferred;
 
     u16 sourceAddr;
-    u16 destAddr;
+    // ppu cycle of the write that started the DMA
+    u64 startCycle;
 
     DMA_OAM_STATE state;
 } OAM;
 
 extern ppu _ppu;
+extern OAM oam;
 extern u8 VRAM[0x2000];
+// number of times the ppu entered VBLANK
+extern u64 vblankCount;
 
 u8 oam_read(u16 addr);
 void oam_write(u16 addr, u8 data);
-u8 read_ppu(u16 addr);
-void write_ppu(u16 addr, u8 data);
+void vram_write(u16 addr, u8 data);
 void ppu_init();
-void ppu_tick();
+void ppu_mapIO();
+void ppu_sync();
+PPU_MODE ppu_currMode();
 
 #endif // PPU_H
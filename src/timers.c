@@ -1,12 +1,17 @@
 #include "timers.h"
 #include "bus.h"
 #include "cpu.h"
+#include "timing.h"
 
 TIMA tima;
-u16 DIV_register;
 u8 TMA_register;
 u8 TAC_register;
 
+// DIV isn't stored, it is the number of cycles since it was last reset
+static u64 DIVresetCycle;
+// cycle up to which TIMA is up to date
+static u64 timerCycles;
+
 static const u16 TACmasks[4] = {[0x00] = 0x0200, [0x01] = 0x0008, [0x02] = 0x0020, [0x03] = 0x0080};
 
 static void TIMA_write(TIMA *tima, u8 val) {
@@ -26,11 +31,11 @@ static void TAC_write(u8 *TAC_register, u8 val) { *TAC_register = (*TAC_register
 
 // credits: https://github.com/pmcanseco/java-gb/blob/master/src/main/java/TimerService.java
 // TODO proper implementation
-static void TIMA_tick(TIMA *tima) {
+static void TIMA_tick(TIMA *tima, u16 DIV) {
     bool new_AND_result;
     bool DIV_bit;
 
-    DIV_bit = DIV_register & tima->mask;
+    DIV_bit = DIV & tima->mask;
     new_AND_result = tima->enable && DIV_bit;
 
     switch (tima->state) {
@@ -48,7 +53,7 @@ static void TIMA_tick(TIMA *tima) {
             tima->cntOverflowCycles++;
             if (tima->cntOverflowCycles == 4) {
                 tima->reg = TMA_register;
-                bit_set(&IF_register, 2);
+                cpu_requestInterrupt(2);
             }
             else if (tima->cntOverflowCycles == 5) {
                 tima->reg = TMA_register;
@@ -67,14 +72,85 @@ static void TIMA_tick(TIMA *tima) {
     tima->AND_result = new_AND_result;
 }
 
+static u16 DIV_at(u64 cycle) { return (u16)(cycle - DIVresetCycle); }
+
+static bool TIMA_isCounting() {
+    // TIMA can be advanced in bulk only while its AND result follows DIV,
+    // writes to DIV and TAC and the overflow reload are stepped through cycle by cycle
+    bool AND_result = tima.enable && (DIV_at(timerCycles) & tima.mask);
+    return tima.state == NORMAL && tima.AND_result == AND_result;
+}
+
+// TIMA increments on the falling edge of the selected DIV bit,
+// which happens every time DIV becomes a multiple of 2 * mask
+static u64 TIMA_overflowCycle() {
+    if (!tima.enable)
+        return NO_EVENT;
+
+    u64 period = tima.mask << 1;
+    u64 nextEdge = ((timerCycles - DIVresetCycle) / period + 1) * period;
+
+    return DIVresetCycle + nextEdge + period * (0xFF - tima.reg);
+}
+
+// caller must make sure TIMA doesn't overflow until cycle
+static void TIMA_countEdges(u64 cycle) {
+    if (tima.enable) {
+        u64 period = tima.mask << 1;
+        tima.reg += (cycle - DIVresetCycle) / period - (timerCycles - DIVresetCycle) / period;
+    }
+    timerCycles = cycle;
+    tima.AND_result = tima.enable && (DIV_at(timerCycles) & tima.mask);
+}
+
+static void timers_tick() {
+    timerCycles++;
+    TIMA_tick(&tima, DIV_at(timerCycles));
+}
+
+static void timers_scheduleOverflow() {
+    if (!TIMA_isCounting())
+        timing_schedule(EVENT_TIMER, timerCycles + 1);
+    else if (tima.enable)
+        // the interrupt is requested 4 cycles after the overflow
+        timing_schedule(EVENT_TIMER, TIMA_overflowCycle() + 4);
+    else
+        timing_cancel(EVENT_TIMER);
+}
+
+void timers_sync() {
+    while (timerCycles < masterCycles) {
+        if (!TIMA_isCounting())
+            timers_tick();
+        else {
+            u64 overflowCycle = TIMA_overflowCycle();
+
+            if (overflowCycle > masterCycles)
+                TIMA_countEdges(masterCycles);
+            else {
+                TIMA_countEdges(overflowCycle - 1);
+                timers_tick();
+            }
+        }
+    }
+    timers_scheduleOverflow();
+}
+
+u16 timers_DIV() {
+    timers_sync();
+    return DIV_at(timerCycles);
+}
+
 u8 timers_read(u16 addr) {
     u8 val = 0xFF;
+
+    timers_sync();
     switch (addr) {
         case 0xFF03:
-            val = u16_lsb(&DIV_register);
+            val = DIV_at(timerCycles) & 0xFF;
             break;
         case 0xFF04:
-            val = u16_msb(&DIV_register);
+            val = DIV_at(timerCycles) >> 8;
             break;
         case 0xFF05:
             val = tima.reg;
@@ -83,17 +159,19 @@ u8 timers_read(u16 addr) {
             val = TMA_register;
             break;
         case 0xFF07:
-            val = TAC_register & 0x07;
+            val = TAC_register;
             break;
     }
     return val;
 }
 
 void timers_write(u16 addr, u8 val) {
+    timers_sync();
+
     switch (addr) {
         case 0xFF03:
         case 0xFF04:
-            DIV_register = 0;
+            DIVresetCycle = timerCycles;
             break;
         case 0xFF05:
             TIMA_write(&tima, val);
@@ -104,13 +182,21 @@ void timers_write(u16 addr, u8 val) {
         case 0xFF07:
             TAC_write(&TAC_register, val);
             TIMA_setAfterTAC(TAC_register, &tima);
-            TIMA_tick(&tima);
+            TIMA_tick(&tima, DIV_at(timerCycles));
             break;
     }
+    timers_scheduleOverflow();
+}
+
+void timers_mapIO() {
+    for (u16 addr = 0xFF03; addr <= 0xFF06; addr++)
+        bus_mapIO(addr, &timers_read, &timers_write, 0x00);
+    bus_mapIO(0xFF07, &timers_read, &timers_write, 0xF8);
 }
 
 void timers_init() {
-    DIV_register = 0xAB00;
+    timers_sync();
+    DIVresetCycle = timerCycles - 0xAB00;
     tima.reg = 0;
     tima.state = NORMAL;
     tima.AND_result = 0;
@@ -119,8 +205,3 @@ void timers_init() {
     TAC_register = 0xF8;
     TIMA_setAfterTAC(TAC_register, &tima);
 }
-
-void timers_tick() {
-    DIV_register++;
-    TIMA_tick(&tima);
-}
@@ -21,11 +21,12 @@ typedef struct TIMA {
 
 u8 timers_read(u16 addr);
 void timers_write(u16 addr, u8 val);
+void timers_mapIO();
 void timers_init();
-void timers_tick();
+void timers_sync();
+u16 timers_DIV();
 
 extern TIMA tima;
-extern u16 DIV_register;
 extern u8 TMA_register;
 extern u8 TAC_register;
 #endif // TIMERS_H
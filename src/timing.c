@@ -1,12 +1,58 @@
 #include "timing.h"
+#include "cpu.h"
 #include "ppu.h"
 #include "timers.h"
 
-void tick_TCycles(uint num_cycles) {
-    for (uint i = 0; i < num_cycles; i++) {
-        timers_tick();
-        ppu_tick();
+u64 masterCycles = 0;
+u64 nextEventCycle = NO_EVENT;
+
+static u64 eventCycles[NUM_EVENTS] = {
+    [EVENT_TIMER] = NO_EVENT,
+    [EVENT_PPU] = NO_EVENT,
+    [EVENT_DMA] = NO_EVENT,
+    [EVENT_DEADLINE] = NO_EVENT,
+};
+
+// each handler syncs its subsystem to masterCycles and schedules its next event
+static void (*const eventHandlers[NUM_EVENTS])() = {
+    [EVENT_TIMER] = timers_sync,
+    [EVENT_PPU] = ppu_sync,
+    [EVENT_DMA] = ppu_sync,
+    // the block that runs past the deadline ends at the next instruction
+    [EVENT_DEADLINE] = cpu_endBlock,
+};
+
+// there are only a handful of events, a linear scan is cheaper than a heap
+static EVENT earliestEvent() {
+    EVENT earliest = 0;
+
+    for (EVENT e = 1; e < NUM_EVENTS; e++) {
+        if (eventCycles[e] < eventCycles[earliest])
+            earliest = e;
     }
+    return earliest;
 }
 
-void tick_MCycle() { tick_TCycles(4); }
+void timing_schedule(EVENT event, u64 cycle) {
+    eventCycles[event] = cycle;
+    nextEventCycle = eventCycles[earliestEvent()];
+}
+
+void timing_cancel(EVENT event) { timing_schedule(event, NO_EVENT); }
+
+void timing_runEvents() {
+    while (nextEventCycle <= masterCycles) {
+        EVENT event = earliestEvent();
+
+        timing_cancel(event);
+        eventHandlers[event]();
+    }
+}
+
+// skip the M cycles that end before the next event, the next tick_MCycle() then runs it
+void timing_skipToEvent() {
+    if (nextEventCycle == NO_EVENT || nextEventCycle <= masterCycles + 4)
+        return;
+
+    masterCycles += (nextEventCycle - masterCycles - 1) / 4 * 4;
+}
@@ -3,7 +3,46 @@
 
 #include "types.h"
 
-void tick_TCycles(uint num_cycles);
-void tick_MCycle();
+#define NO_EVENT UINT64_MAX
+
+// every subsystem that must be brought up to date at a known cycle
+typedef enum EVENT {
+    EVENT_TIMER,    // TIMA overflow interrupt
+    EVENT_PPU,      // PPU mode transitions, VBLANK and STAT interrupts
+    EVENT_DMA,      // OAM DMA completion
+    EVENT_DEADLINE, // end of cpu_runUntilCycle()
+    NUM_EVENTS
+} EVENT;
+
+// number of T cycles since power on
+extern u64 masterCycles;
+// cycle of the earliest scheduled event
+extern u64 nextEventCycle;
+
+void timing_schedule(EVENT event, u64 cycle);
+void timing_cancel(EVENT event);
+void timing_runEvents();
+void timing_skipToEvent();
+
+#ifdef BATCHED_TIMING
+// the events that come due during an instruction are run by timing_catchUp(), between instructions
+// and before the accesses that can observe them
+static inline void tick_TCycles(uint num_cycles) { masterCycles += num_cycles; }
+#else
+// advance the clock, the subsystems only run when one of their events is due
+static inline void tick_TCycles(uint num_cycles) {
+    masterCycles += num_cycles;
+    if (masterCycles >= nextEventCycle)
+        timing_runEvents();
+}
+#endif
+
+// nothing is due here unless the events were deferred
+static inline void timing_catchUp() {
+    if (masterCycles >= nextEventCycle)
+        timing_runEvents();
+}
+
+static inline void tick_MCycle() { tick_TCycles(4); }
 
 #endif // TIMING_H
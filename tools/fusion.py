@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+# merges the opcode pair counts written by a PROFILE_PAIRS build and prints fusion.h with the most frequent pairs,
+# cpu_init only fuses the pairs whose handlers have a fused handler in FUSED_LIST
+import argparse
+import sys
+
+# a block ends after these, the next opcode is never in the same block
+BLOCK_ENDS = {0x10, 0x18, 0x20, 0x28, 0x30, 0x38, 0x76, 0xC0, 0xC2, 0xC3, 0xC4, 0xC8, 0xC9, 0xCA, 0xCC, 0xCD, 0xD0, 0xD2, 0xD4, 0xD8, 0xD9, 0xDA, 0xDC, 0xE9, 0xF3, 0xFB}
+BLOCK_ENDS |= set(range(0xC7, 0x100, 8))
+
+HEADER = """#ifndef FUSION_H
+#define FUSION_H
+
+// opcode pairs that run as a single fused handler when they follow each other in a block, most frequent first,
+// CB prefixed opcodes are 0x100 | opcode. Generated by tools/fusion.py from {files} .pairs files
+#define FUSION_PAIRS(X)"""
+
+
+def macro_line(text):
+    return text.ljust(199) + "\\"
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("files", nargs="+", help=".pairs files")
+    parser.add_argument("--top", type=int, default=32, help="number of pairs to keep")
+    args = parser.parse_args()
+
+    counts = {}
+    for path in args.files:
+        with open(path) as f:
+            for line in f:
+                first, second, count = line.split()
+                pair = (int(first, 16), int(second, 16))
+                counts[pair] = counts.get(pair, 0) + int(count)
+
+    total = sum(counts.values())
+    if total == 0:
+        sys.exit("no pairs in " + " ".join(args.files))
+
+    # the second opcode of a fused pair is never prefixed
+    pairs = [p for p in counts if p[0] not in BLOCK_ENDS and p[1] <= 0xFF]
+    pairs.sort(key=lambda p: counts[p], reverse=True)
+    pairs = pairs[: args.top]
+
+    lines = HEADER.format(files=len(args.files)).split("\n")
+    lines[-1] = macro_line(lines[-1])
+    for i, (first, second) in enumerate(pairs):
+        entry = "    X(0x%02X, 0x%02X) /* %.2f%% */" % (first, second, 100.0 * counts[(first, second)] / total)
+        lines.append(macro_line(entry) if i != len(pairs) - 1 else entry)
+    lines += ["", "#endif"]
+    print("\n".join(lines))
+
+
+if __name__ == "__main__":
+    main()